@@ -1,6 +1,49 @@
 #include <bcm2835.h>
+#include <time.h>
 #include "GPIO.h"
 
+#define NS_PER_SEC      1000000000ULL
+
+const uint8_t levels[8] = {
+    LEVEL1, LEVEL2, LEVEL3, LEVEL4, LEVEL5, LEVEL6, LEVEL7, LEVEL8
+};
+
+// --- Driver ----
+
+static void gpio_latch(void *context, uint8_t *buffer) {
+    bcm2835_spi_writenb((char *)buffer, 24);
+}
+
+static void gpio_show(void *context, uint8_t level, uint8_t bit, bool on) {
+    // Turn off previous level and turn on the current one.
+    bcm2835_gpio_set(levels[level == 0 ? 7 : level - 1]);
+    if (on) {
+        bcm2835_gpio_clr(levels[level]);
+    }
+}
+
+static void gpio_wait(void *context, uint64_t deadline) {
+    struct timespec time = {
+        .tv_sec = deadline / NS_PER_SEC, .tv_nsec = deadline % NS_PER_SEC
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL);
+}
+
+static uint64_t gpio_clock(void *context) {
+    return monotonic_ns();
+}
+
+struct Driver gpio_driver = {
+    .latch = gpio_latch,
+    .show = gpio_show,
+    .wait = gpio_wait,
+    .clock = gpio_clock,
+    .frame = NULL,
+    .context = NULL,
+};
+
+// --- Exposed functions ----
+
 /**
  * Turn off all LEDs and finalize SPI.
  */
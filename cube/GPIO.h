@@ -4,6 +4,8 @@
 #include <bcm2835.h>
 #include <stdbool.h>
 
+#include "animation.h"
+
 #define ENABLE          RPI_BPLUS_GPIO_J8_15
 
 #define LEVEL1          RPI_BPLUS_GPIO_J8_37
@@ -15,6 +17,12 @@
 #define LEVEL7          RPI_BPLUS_GPIO_J8_38
 #define LEVEL8          RPI_BPLUS_GPIO_J8_40
 
+/// Array of LEDs levels where i=0 is the bottom-most and 8 is the top-most
+extern const uint8_t levels[8];
+
+/// Refresh loop output that drives the real cube through SPI and GPIOs.
+extern struct Driver gpio_driver;
+
 /**
  * Turn off all LEDs and finalize SPI.
  */
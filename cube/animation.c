@@ -1,20 +1,29 @@
 #include "animation.h"
-#include "GPIO.h"
+#include "interpolation.h"
 #include "parser.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 
-#define DUTY_DELAY_NS    124
 #define ANIMATION_FILE   "/opt/lyft/lyftcube/cube/animations/current_animation"
 
+#define NS_PER_SEC              1000000000ULL
+#define NS_PER_MILLISECOND      1000000ULL
+
+/// Frames shorter than a BAM cycle are skipped by the refresh loop, so their
+/// durations are kept as they are; they're only kept above zero (and below a
+/// day) so the frame clock always moves forward.
+#define MIN_FRAME_NS            1
+#define MAX_FRAME_NS            (24 * 3600 * NS_PER_SEC)
+
+/// When the refresh loop falls this far behind the frame clock (e.g. the
+/// process was stopped) we resync instead of racing through the frames.
+#define MAX_FRAME_LAG_NS        NS_PER_SEC
 
-const uint8_t levels[8] = {
-    LEVEL1, LEVEL2, LEVEL3, LEVEL4, LEVEL5, LEVEL6, LEVEL7, LEVEL8
-};
 
 /** Bit angle modulation works this way: we set a brightness between [0, 15]
  *  (4 bits), each bit of that number defines if the color should be on for
@@ -26,8 +35,103 @@ const uint8_t levels[8] = {
  *  - Turn red OFF while we cycle the second bit (2 passes)
  *  - Turn red OFF while we cycle the third bit (4 passes)
  *  - Turn red ON while we cycle the fourth bit (8 passes)
+ *
+ *  The array is generated by `set_bam_mode` from BAM_BITS; on interleaved
+ *  mode the passes of each bit are spread across the cycle instead.
  */
-static const uint8_t BAM[] = {0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3};
+static uint8_t BAM[BAM_STEPS];
+
+/**
+ * Generates the BAM schedule used by the refresh loop. Since the slot flags
+ * depend on the schedule, this must be called before any animation is
+ * prepared.
+ *
+ * - parameter mode: The schedule to generate (see `enum BAMMode`).
+ */
+void set_bam_mode(enum BAMMode mode) {
+    uint8_t step = 0;
+    switch (mode) {
+        case BAM_BINARY:
+            for (uint8_t bit = 0; bit < BAM_BITS; bit++) {
+                for (uint8_t pass = 0; pass < (1 << bit); pass++) {
+                    BAM[step++] = bit;
+                }
+            }
+            break;
+
+        // Step i gets the bit given by the trailing zeros of (i + 1): the MSB
+        // takes every other step, the next bit every fourth step and so on,
+        // which is exactly 2^bit steps per bit.
+        case BAM_INTERLEAVED:
+            for (step = 0; step < BAM_STEPS; step++) {
+                BAM[step] = BAM_BITS - 1 - __builtin_ctz(step + 1);
+            }
+            break;
+    }
+}
+
+/**
+ * Parses a BAM mode name as given on the command line ("binary" or
+ * "interleaved").
+ *
+ * - parameter name: The name of the mode.
+ * - parameter mode: A pointer where the parsed mode will be stored.
+ */
+bool parse_bam_mode(const char *name, enum BAMMode *mode) {
+    if (strcmp(name, "binary") == 0) {
+        *mode = BAM_BINARY;
+    } else if (strcmp(name, "interleaved") == 0) {
+        *mode = BAM_INTERLEAVED;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Parses a playback speed multiplier as given on the command line; it must
+ * be a finite number greater than 0.
+ *
+ * - parameter text:  The speed (e.g. "0.5").
+ * - parameter speed: A pointer where the parsed speed will be stored.
+ */
+bool parse_speed(const char *text, double *speed) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !isfinite(value) || value <= 0) {
+        return false;
+    }
+
+    *speed = value;
+    return true;
+}
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+/**
+ * Returns how long the given frame should stay on the cube, in nanoseconds.
+ *
+ * - parameter frame: The frame whose duration (milliseconds) will be used.
+ * - parameter speed: Global speed multiplier (1.0 plays as authored).
+ */
+static uint64_t frame_duration_ns(struct Frame *frame, double speed) {
+    double duration = (double)frame->duration * NS_PER_MILLISECOND / speed;
+
+    // A zero duration would never move the frame clock forward.
+    if (!(duration >= MIN_FRAME_NS)) {
+        return MIN_FRAME_NS;
+    }
+
+    return duration < MAX_FRAME_NS ? (uint64_t)duration : MAX_FRAME_NS;
+}
 
 /**
  * Parses the animation that should be played next based on the content of the
@@ -47,7 +151,9 @@ bool load_current_animation(struct Animation *animation, char *path) {
 
     // Read current animation path from ANIMATION_FILE
     char gif_path[PATH_MAX + 1];
-    if (fgets(gif_path, PATH_MAX, file) == NULL) {
+    bool read = fgets(gif_path, PATH_MAX, file) != NULL;
+    fclose(file);
+    if (!read) {
         fprintf(stderr, "Invalid animation path in %s", ANIMATION_FILE);
         return false;
     }
@@ -64,60 +170,290 @@ bool load_current_animation(struct Animation *animation, char *path) {
         return false;
     }
 
+    prepare_animation(animation);
+
     strcpy(path, gif_path);
     return true;
 }
 
+/**
+ * Computes the `same`/`off` flags of a single frame (see `struct Frame`).
+ *
+ * - parameter frame: The frame whose bit planes are already set.
+ */
+void compute_slot_flags(struct Frame *frame) {
+    static const uint8_t zeros[24] = {0};
+    uint8_t *latched = NULL;
+
+    memset(frame->same, 0, sizeof(frame->same));
+    memset(frame->off, 0, sizeof(frame->off));
+
+    // The first pass only finds out what the end of the cycle leaves
+    // latched, so the first slots of the next cycle can be compared too.
+    for (uint8_t pass = 0; pass < 2; pass++) {
+        for (uint8_t step = 0; step < BAM_STEPS; step++) {
+            for (uint8_t level = 0; level < 8; level++) {
+                uint8_t *plane = frame->cube[BAM[step]][level];
+                if (memcmp(plane, zeros, sizeof(zeros)) == 0) {
+                    frame->off[step] |= 1 << level;
+                    continue;
+                }
+
+                if (pass == 1 && latched != NULL &&
+                    memcmp(plane, latched, sizeof(zeros)) == 0)
+                {
+                    frame->same[step] |= 1 << level;
+                }
+
+                latched = plane;
+            }
+        }
+    }
+}
+
+/**
+ * Computes the per-slot `same`/`off` flags of every frame in the animation
+ * and resets its refresh stats (see `print_refresh_stats`). Must be called
+ * after the frames are parsed and before they are multiplexed.
+ *
+ * - parameter animation: The animation whose frames will be prepared.
+ */
+void prepare_animation(struct Animation *animation) {
+    uint32_t skipped = 0;
+    uint32_t frames_count = animation->frames_count * animation->phases;
+    for (uint32_t i = 0; i < frames_count; i++) {
+        struct Frame *frame = &animation->frames[i];
+        compute_slot_flags(frame);
+
+        for (uint8_t step = 0; step < BAM_STEPS; step++) {
+            uint8_t skip = frame->same[step] | frame->off[step];
+            skipped += __builtin_popcount(skip);
+        }
+    }
+
+    memset(&animation->stats, 0, sizeof(animation->stats));
+    animation->stats.loop_slots = frames_count * BAM_STEPS * 8;
+    animation->stats.loop_skipped = skipped;
+}
+
+/**
+ * Prints how many of the animation's slots don't need an SPI transfer, how
+ * many transfers the refresh loop skipped while playing it and how much bus
+ * time that saved.
+ *
+ * - parameter animation: The animation that was (or is being) played.
+ */
+void print_refresh_stats(struct Animation *animation) {
+    struct RefreshStats *stats = &animation->stats;
+    if (stats->slots == 0) {
+        return;
+    }
+
+    printf("SPI: %u of %u slots per loop don't need a transfer (%.1f%%)\n",
+           stats->loop_skipped, stats->loop_slots,
+           stats->loop_slots ? 100.0 * stats->loop_skipped / stats->loop_slots
+                             : 0);
+
+    uint64_t skipped = stats->skipped_same + stats->skipped_off;
+    printf("SPI: skipped %llu of %llu transfers (%.1f%%; %llu same, %llu off),"
+           " saved %.1f ms of bus time\n",
+           (unsigned long long)skipped, (unsigned long long)stats->slots,
+           100.0 * skipped / stats->slots,
+           (unsigned long long)stats->skipped_same,
+           (unsigned long long)stats->skipped_off,
+           (double)(skipped * SPI_LEVEL_NS) / 1e6);
+}
+
+/**
+ * Returns the given phase of the animation's frame at `frame_index`.
+ */
+static struct Frame *animation_frame(struct Animation *animation,
+                                     uint32_t frame_index, uint8_t phase)
+{
+    uint32_t index = frame_index % animation->frames_count;
+    return &animation->frames[index * animation->phases + phase];
+}
+
+/**
+ * Picks the frame to display during the next BAM cycle: the live source's
+ * frame if there's one or the animation's current frame (the phase of the
+ * cycle when dithered, or blended into the next frame when interpolating),
+ * post-processed by the filter.
+ */
+static struct Frame *select_frame(struct Animation *animation,
+                                  uint32_t frame_index, uint32_t cycle,
+                                  struct Frame *live, struct Options *options,
+                                  uint64_t now, uint64_t deadline)
+{
+    struct Frame *frame = live ?: animation_frame(animation, frame_index,
+                                                  cycle % animation->phases);
+
+    // Fading and dithering are exclusive (lyftcube rejects -f with -d), so
+    // keyframes have a single phase when blending.
+    if (live == NULL && options->interpolator != NULL) {
+        frame = animation_frame(animation, frame_index, 0);
+        uint64_t duration = frame_duration_ns(frame, options->speed);
+        uint64_t elapsed = now + duration > deadline ?
+                           now + duration - deadline : 0;
+        struct Frame *next = animation_frame(animation, frame_index + 1, 0);
+        frame = interpolate(options->interpolator, frame, next, elapsed,
+                            duration);
+    }
+
+    if (options->filter != NULL) {
+        frame = options->filter->apply(options->filter->context, frame, now);
+    }
+
+    return frame;
+}
+
 /**
  * Performs given animation by multiplexing cube levels. It uses bit angle
  * modulation to control the brightness of each color.
  *
+ * Frames are advanced against CLOCK_MONOTONIC so the animation tempo matches
+ * the GIF delays regardless of how long each BAM cycle actually takes.
+ *
  * - parameter animation: The animation to multiplex including all frames.
- * - parameter pretend:   When true we'll print on the screen every LED
- *                        level using a slowed-down BAM rate (debug only).
+ * - parameter driver:    The output (real cube, simulator, ...) to drive.
+ * - parameter options:   Playback settings (speed, live source, ...).
  */
-void multiplex(struct Animation *animation, bool pretend) {
+void multiplex(struct Animation *animation, struct Driver *driver,
+               struct Options *options)
+{
     uint8_t level = 0;
     uint8_t BAM_index = 0;
     uint32_t frame_index = 0;
+    uint32_t cycle = 0;
     uint32_t *frame_count = &animation->frames_count;
-    uint16_t frame_delay = 0;
+    struct RefreshStats *stats = &animation->stats;
+    struct Source *source = options->source;
+
+    struct AnimationSwap *swap = options->swap;
+    void *context = driver->context;
 
-    struct timespec sleep_time;
-    sleep_time.tv_sec = pretend ? 1 : 0;
-    sleep_time.tv_nsec = 1000 * (long)(DUTY_DELAY_NS);
+    // The slot flags describe a frame played on its own; whatever was latched
+    // before we switched to it is unknown, so the first plane is always sent.
+    struct Frame *latched_frame = NULL;
+    struct Frame *live_frame = NULL;
+
+    uint64_t now = driver->clock(context);
+    uint64_t frame_deadline = now +
+        frame_duration_ns(animation_frame(animation, 0, 0), options->speed);
+    struct Frame *frame = select_frame(animation, frame_index, cycle,
+                                       live_frame, options, now,
+                                       frame_deadline);
+
+    // When the level of the current slot is turned on.
+    uint64_t show_at = now + SPI_LEVEL_NS;
 
     while (1) {
-        struct Frame *frame = &animation->frames[frame_index % *frame_count];
+        stats->slots++;
+
         int bit = BAM[BAM_index];
+        uint8_t level_mask = 1 << level;
+        bool on = !(frame->off[BAM_index] & level_mask);
 
-        if (pretend) {
-            printf("=========== bit: %d, level: %d ============\n", bit, level);
-            dump_buffer(frame->cube[bit][level]);
+        // The transfer starts SPI_LEVEL_NS before the level is turned on,
+        // and a skipped one is waited for all the same: otherwise skipping
+        // would shorten the time the previous level stays lit.
+        driver->wait(context, show_at - SPI_LEVEL_NS);
+        if (!on) {
+            stats->skipped_off++;
+        } else if (frame != latched_frame ||
+                   !(frame->same[BAM_index] & level_mask))
+        {
+            driver->latch(context, frame->cube[bit][level]);
+            latched_frame = frame;
         } else {
-            bcm2835_spi_writenb((char *)frame->cube[bit][level], 24);
-
-            // Turn off previous level and turn on the current one.
-            bcm2835_gpio_set(levels[level == 0 ? 7 : level - 1]);
-            bcm2835_gpio_clr(levels[level]);
+            stats->skipped_same++;
         }
 
+        driver->wait(context, show_at);
+        driver->show(context, level, bit, on);
+        show_at += SLOT_NS;
+
         // Move to the next level (or cycle when the 8th level is reached),
         // at that point we also increment the BAM index to start the next
         // BAM cycle.
-        if (++level == 8) {
-            level = 0;
+        if (++level < 8) {
+            continue;
+        }
 
-            if (++BAM_index == 0b1111) {
-                BAM_index = 0;
+        level = 0;
+        if (++BAM_index < BAM_STEPS) {
+            continue;
+        }
 
-                if (++frame_delay >= frame->duration) {
-                    frame_delay = 0;
-                    frame_index = (frame_index + 1) % *frame_count;
-                }
+        BAM_index = 0;
+        cycle++;
+
+        // Frames only change on BAM cycle boundaries so every level of a
+        // frame gets the full brightness resolution. Being late skips frames
+        // rather than slowing the animation down.
+        now = driver->clock(context);
+        if (now >= frame_deadline + MAX_FRAME_LAG_NS) {
+            frame_deadline = now;
+        }
+
+        // Slots that are already late (e.g. the process was preempted) are
+        // not raced through.
+        if (now > show_at) {
+            show_at = now + SPI_LEVEL_NS;
+        }
+
+        // A new animation starts from its first frame. The old frames stay
+        // valid until the loader sees the swap is done, and nothing below
+        // keeps pointers to them.
+        if (swap != NULL && __atomic_load_n(&swap->pending, __ATOMIC_ACQUIRE))
+        {
+            struct Animation previous = *animation;
+            *animation = swap->next;
+            swap->next = previous;
+            __atomic_store_n(&swap->pending, false, __ATOMIC_RELEASE);
+
+            if (options->interpolator != NULL) {
+                reset_interpolation(options->interpolator);
+            }
+
+            frame_index = 0;
+            frame_deadline = now + frame_duration_ns(
+                animation_frame(animation, 0, 0), options->speed);
+            latched_frame = NULL;
+        }
+
+        // Once a whole loop of the animation fits in the time to catch up
+        // with, the clock is resynced instead of skipping the same frames
+        // over and over (very short frames or high speeds).
+        bool frame_ended = now >= frame_deadline;
+        for (uint32_t skipped = 0; now >= frame_deadline; skipped++) {
+            if (skipped == *frame_count) {
+                frame_deadline = now;
             }
+
+            frame_index = (frame_index + 1) % *frame_count;
+            frame_deadline += frame_duration_ns(
+                animation_frame(animation, frame_index, 0), options->speed);
+        }
+
+        // Live frames are picked up on cycle boundaries too; the animation
+        // keeps its own clock underneath.
+        if (source != NULL) {
+            live_frame = source->poll(source->context);
         }
 
-        nanosleep(&sleep_time, NULL);
+        struct Frame *next = select_frame(animation, frame_index, cycle,
+                                          live_frame, options, now,
+                                          frame_deadline);
+        if (next != frame) {
+            frame = next;
+            latched_frame = NULL;
+        }
+
+        if (frame_ended && driver->frame != NULL &&
+            !driver->frame(context, frame_index))
+        {
+            return;
+        }
     }
 }
@@ -5,6 +5,12 @@
 #include <stdint.h>
 #include <linux/limits.h>
 
+/// Bits of brightness per color, i.e. number of bit planes.
+#define BAM_BITS         4
+
+/// Number of level sweeps on a full BAM cycle (1 + 2 + 4 + 8).
+#define BAM_STEPS        ((1 << BAM_BITS) - 1)
+
 /**
  * This matrix represents the current state of the LED cube, the first
  * dimension represents the bit on the Bit Angle Modulation cycle, the
@@ -26,30 +32,254 @@
  * would be (ith + 8) and Blue (ith + 16).
  *
  */
-typedef uint8_t LEDCube[4][8][24];
+typedef uint8_t LEDCube[BAM_BITS][8][24];
+
+/// Time each level stays on, on top of the transfer of the next level.
+#define DUTY_DELAY_US    124
+
+/// Time it takes to shift one byte into the LED drivers with the SPI clock
+/// configured in GPIO.c (250MHz / 32).
+#define SPI_BYTE_NS      1024
+
+/// Time it takes to shift a level (8 rows x 3 colors) into the LED drivers.
+#define SPI_LEVEL_NS     (24 * SPI_BYTE_NS)
 
+/// Time between two levels being turned on. The next level is shifted while
+/// the current one is still lit, so a slot is the duty delay plus a full
+/// transfer, whether the transfer is skipped or not.
+#define SLOT_NS          (DUTY_DELAY_US * 1000ULL + SPI_LEVEL_NS)
+
+/// GIF delays of 0 or 1 centiseconds (and raw delays of 0 milliseconds) are
+/// played at this rate, the same way browsers (and the designer app preview)
+/// do.
+#define DEFAULT_DELAY_MS 100
+
+/**
+ * The bit planes are word aligned so they can be processed a word at a time
+ * (see layers.c). Frames are shown for `duration` milliseconds, the
+ * precision of raw uploads (GIF delays are centiseconds). Every frame also
+ * holds one bitmask (bit i for level i) per BAM step, computed at load time
+ * by `prepare_animation`:
+ *
+ * - same: The plane is identical to the one the refresh loop latched last,
+ *         so there's no need to shift it again.
+ * - off:  The plane is all zeros; the level stays dark and nothing is sent.
+ */
 struct Frame {
-    LEDCube cube;
-    uint16_t duration;
+    LEDCube cube __attribute__((aligned(4)));
+    uint32_t duration;
+    uint8_t same[BAM_STEPS];
+    uint8_t off[BAM_STEPS];
 };
 
+/**
+ * Counters kept by the refresh loop for the animation being played. Every
+ * slot is either latched (sent over SPI) or skipped for one of the reasons
+ * above. `loop_slots` and `loop_skipped` describe one pass over all of the
+ * animation's frames, as computed by `prepare_animation`.
+ */
+struct RefreshStats {
+    uint64_t slots;
+    uint64_t skipped_same;
+    uint64_t skipped_off;
+    uint32_t loop_slots;
+    uint32_t loop_skipped;
+};
+
+/**
+ * The frames of an animation. When it's dithered every frame is stored as
+ * `phases` consecutive frames (all with the same duration) that are shown on
+ * consecutive BAM cycles, so frame i, phase p is `frames[i * phases + p]`.
+ */
 struct Animation {
     struct Frame *frames;
     uint32_t frames_count;
+    uint8_t phases;
+    struct RefreshStats stats;
+};
+
+/**
+ * Hands an animation loaded outside of the refresh loop (e.g. on SIGHUP) to
+ * it. The loader stores the animation in `next` and sets `pending`; on its
+ * next BAM cycle boundary the refresh loop swaps it with the one being
+ * played and clears `pending`, which leaves the previous animation in `next`
+ * for the loader to free.
+ */
+struct AnimationSwap {
+    struct Animation next;
+    bool pending;
+};
+
+/**
+ * Order in which bit planes are swept during a BAM cycle. Both modes keep
+ * every bit on for 2^bit sweeps (same duty cycle and SPI cost), they only
+ * differ on how those sweeps are spread:
+ *
+ * - BAM_BINARY:      Each bit's sweeps are consecutive (0, 1, 1, 2, 2, 2, ...)
+ * - BAM_INTERLEAVED: Sweeps of the high order bits are sliced and spread
+ *                    evenly across the cycle (3, 2, 3, 1, 3, 2, 3, 0, ...),
+ *                    which shortens the longest dark runs and reduces
+ *                    flicker on low refresh rates.
+ */
+enum BAMMode {
+    BAM_BINARY,
+    BAM_INTERLEAVED,
+};
+
+/**
+ * A live producer of frames (e.g. the audio visualizers) that takes over the
+ * animation while it has something to show.
+ *
+ * - poll: Called by the refresh loop on every BAM cycle boundary with
+ *         `context`. Returns the frame to display during the next cycle
+ *         (with its slot flags already computed), or NULL to play the
+ *         animation's frames.
+ *
+ * Frames returned by sources and filters must not change while they are
+ * displayed; new content has to come in a different frame (pointer).
+ */
+struct Source {
+    struct Frame *(*poll)(void *context);
+    void *context;
+};
+
+/**
+ * Post-processing of the frame picked for the next BAM cycle (e.g. the
+ * overlay layers).
+ *
+ * - apply: Called on every BAM cycle boundary with `context`, the frame that
+ *          would be displayed and the current time in nanoseconds. Returns
+ *          the frame to display instead (with its slot flags computed),
+ *          which can be the given one.
+ */
+struct Filter {
+    struct Frame *(*apply)(void *context, struct Frame *frame, uint64_t now);
+    void *context;
+};
+
+struct Interpolator;
+
+/**
+ * Playback settings given on the command line.
+ *
+ * - speed:    Multiplier applied to every frame's delay; 2.0 plays twice as
+ *             fast as authored, 0.5 at half speed.
+ * - bam_mode: Bit angle modulation schedule (see `enum BAMMode`).
+ * - source:   Optional live source of frames (see `struct Source`).
+ * - filter:   Optional post-processing of every frame (see `struct Filter`).
+ * - interpolator: Optional; blends every frame of the animation into the
+ *                 next one while it's played (see interpolation.h). Only
+ *                 the first dithering phase is blended, so it's not used
+ *                 along with dithering.
+ * - swap:     Optional; animations that replace the one being played (see
+ *             `struct AnimationSwap`).
+ */
+struct Options {
+    double speed;
+    enum BAMMode bam_mode;
+    struct Source *source;
+    struct Filter *filter;
+    struct Interpolator *interpolator;
+    struct AnimationSwap *swap;
 };
 
-/// Array of LEDs levels where i=0 is the bottom-most and 8 is the top-most
-extern const uint8_t levels[8];
+/**
+ * The output the refresh loop drives. The real cube is driven through
+ * `gpio_driver` (GPIO.c); the simulator and the pretend mode provide their
+ * own implementations. Every function receives `context` as first argument.
+ *
+ * - latch: Shifts the 24 bytes of a level (8 rows x 3 colors) into the LED
+ *          drivers.
+ * - show:  Turns off the previously lit level and turns on the given one
+ *          (unless `on` is false, when the whole level is dark). `bit` is
+ *          the bit plane being shown.
+ * - wait:  Blocks until the given time (as returned by `clock`). Slots are
+ *          paced from these absolute deadlines so their length doesn't
+ *          depend on the transfers skipped or the work done in them.
+ * - clock: Returns a monotonic time in nanoseconds, used to advance frames.
+ * - frame: Optional; called on every BAM cycle boundary where the refresh
+ *          loop moves to a new frame (including looping over a single frame
+ *          animation). Returning false stops the refresh loop.
+ */
+struct Driver {
+    void (*latch)(void *context, uint8_t *buffer);
+    void (*show)(void *context, uint8_t level, uint8_t bit, bool on);
+    void (*wait)(void *context, uint64_t deadline);
+    uint64_t (*clock)(void *context);
+    bool (*frame)(void *context, uint32_t frame_index);
+    void *context;
+};
+
+/**
+ * Generates the BAM schedule used by the refresh loop. Since the slot flags
+ * depend on the schedule, this must be called before any animation is
+ * prepared.
+ *
+ * - parameter mode: The schedule to generate (see `enum BAMMode`).
+ */
+void set_bam_mode(enum BAMMode mode);
+
+/**
+ * Parses a BAM mode name as given on the command line ("binary" or
+ * "interleaved").
+ *
+ * - parameter name: The name of the mode.
+ * - parameter mode: A pointer where the parsed mode will be stored.
+ */
+bool parse_bam_mode(const char *name, enum BAMMode *mode);
+
+/**
+ * Parses a playback speed multiplier as given on the command line; it must
+ * be a finite number greater than 0.
+ *
+ * - parameter text:  The speed (e.g. "0.5").
+ * - parameter speed: A pointer where the parsed speed will be stored.
+ */
+bool parse_speed(const char *text, double *speed);
+
+/**
+ * Computes the per-slot `same`/`off` flags of every frame in the animation
+ * and resets its refresh stats (see `print_refresh_stats`). Must be called
+ * after the frames are parsed and before they are multiplexed.
+ *
+ * - parameter animation: The animation whose frames will be prepared.
+ */
+void prepare_animation(struct Animation *animation);
+
+/**
+ * Computes the `same`/`off` flags of a single frame (see `struct Frame`).
+ *
+ * - parameter frame: The frame whose bit planes are already set.
+ */
+void compute_slot_flags(struct Frame *frame);
+
+/**
+ * Prints how many of the animation's slots don't need an SPI transfer, how
+ * many transfers the refresh loop skipped while playing it and how much bus
+ * time that saved.
+ *
+ * - parameter animation: The animation that was (or is being) played.
+ */
+void print_refresh_stats(struct Animation *animation);
 
 /**
  * Performs given animation by multiplexing cube levels. It uses bit angle
  * modulation to control the brightness of each color.
  *
+ * Frames are advanced against CLOCK_MONOTONIC so the animation tempo matches
+ * the GIF delays regardless of how long each BAM cycle actually takes.
+ *
  * - parameter animation: The animation to multiplex including all frames.
- * - parameter pretend:   When true we'll print on the screen every LED
- *                        level using a slowed-down BAM rate (debug only).
+ * - parameter driver:    The output (real cube, simulator, ...) to drive.
+ * - parameter options:   Playback settings (speed).
+ */
+void multiplex(struct Animation *animation, struct Driver *driver,
+               struct Options *options);
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
  */
-void multiplex(struct Animation *animation, bool pretend);
+uint64_t monotonic_ns(void);
 
 /**
  * Parses the animation that should be played next based on the content of the
@@ -0,0 +1,476 @@
+#include "audio.h"
+#include "queue.h"
+#include "visualizers.h"
+#include "voxels.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+#define MIN_FREQUENCY       40.0f
+#define MAX_FREQUENCY       16000.0f
+
+/// Bands are mapped from [-DYNAMIC_RANGE_DB, 0] dBFS to [0, 1] ...
+#define DYNAMIC_RANGE_DB    60.0f
+
+/// ... then normalized against a peak that slowly decays, so quiet songs
+/// still fill the cube, and they fall by at most BAND_FALLOFF per frame.
+#define PEAK_DECAY          0.998f
+#define MIN_PEAK            0.25f
+#define BAND_FALLOFF        0.06f
+
+#define REPORT_INTERVAL_NS  5000000000ULL
+
+struct AudioSource {
+    // Input
+    int fd;
+    bool paced;
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint8_t pending[4];
+    uint8_t pending_count;
+    int16_t pcm[AUDIO_HOP_SIZE * AUDIO_MAX_CHANNELS];
+
+    // Analysis
+    const struct Visualizer *visualizer;
+    float samples[AUDIO_FFT_SIZE];
+    float window[AUDIO_FFT_SIZE];
+    float real[AUDIO_FFT_SIZE];
+    float imaginary[AUDIO_FFT_SIZE];
+    float cosines[AUDIO_FFT_SIZE / 2];
+    float sines[AUDIO_FFT_SIZE / 2];
+    uint16_t band_edges[VISUALIZER_BANDS + 1];
+    float bands[VISUALIZER_BANDS];
+    float peak;
+
+    // Output; `finished` is set by the producer when the input is over and
+    // the latency counters are written by the consumer.
+    struct FrameQueue queue;
+    bool finished;
+    uint64_t latency_sum;
+    uint64_t latency_max;
+    uint32_t latency_count;
+    uint64_t processing_max;
+
+    pthread_t thread;
+};
+
+// --- Input ----
+
+/**
+ * Reads exactly `size` bytes unless the input is over, returning how many
+ * bytes were read. The bytes peeked while sniffing the format come first.
+ */
+static size_t read_input(struct AudioSource *audio, void *buffer, size_t size) {
+    uint8_t *bytes = buffer;
+    size_t total = MIN(size, audio->pending_count);
+    memcpy(bytes, audio->pending, total);
+    memmove(audio->pending, audio->pending + total,
+            audio->pending_count - total);
+    audio->pending_count -= total;
+
+    while (total < size) {
+        ssize_t count = read(audio->fd, bytes + total, size - total);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            break;
+        }
+
+        total += count;
+    }
+
+    return total;
+}
+
+static uint32_t little_endian(const uint8_t *bytes, uint8_t size) {
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < size; i++) {
+        value |= (uint32_t)bytes[i] << (8 * i);
+    }
+    return value;
+}
+
+/**
+ * Parses the WAV header (if there's one) leaving the input at the start of
+ * the samples. Anything not starting with "RIFF" is taken as raw PCM.
+ */
+static bool read_header(struct AudioSource *audio) {
+    audio->sample_rate = AUDIO_RAW_RATE;
+    audio->channels = AUDIO_RAW_CHANNELS;
+
+    uint8_t riff[12];
+    if (read_input(audio, riff, 4) != 4) {
+        return false;
+    }
+
+    if (memcmp(riff, "RIFF", 4) != 0) {
+        memcpy(audio->pending, riff, 4);
+        audio->pending_count = 4;
+        return true;
+    }
+
+    if (read_input(audio, riff + 4, 8) != 8 || memcmp(riff + 8, "WAVE", 4)) {
+        fprintf(stderr, "Invalid WAV header\n");
+        return false;
+    }
+
+    uint8_t chunk[8], format[16];
+    while (read_input(audio, chunk, 8) == 8) {
+        uint32_t size = little_endian(chunk + 4, 4);
+        if (memcmp(chunk, "data", 4) == 0) {
+            return true;
+        }
+
+        if (memcmp(chunk, "fmt ", 4) == 0 && size >= sizeof(format)) {
+            if (read_input(audio, format, sizeof(format)) != sizeof(format)) {
+                break;
+            }
+
+            audio->channels = little_endian(format + 2, 2);
+            audio->sample_rate = little_endian(format + 4, 4);
+            if (little_endian(format, 2) != 1 ||
+                little_endian(format + 14, 2) != 16)
+            {
+                fprintf(stderr, "Only 16 bits PCM WAV files are supported\n");
+                return false;
+            }
+
+            if (audio->channels == 0 || audio->channels > AUDIO_MAX_CHANNELS ||
+                audio->sample_rate == 0)
+            {
+                fprintf(stderr, "Unsupported WAV format (%u channels, %u "
+                        "Hz)\n", audio->channels, audio->sample_rate);
+                return false;
+            }
+
+            size -= sizeof(format);
+        }
+
+        // Chunks are word aligned
+        uint8_t skipped;
+        for (uint32_t i = 0; i < size + (size & 1); i++) {
+            if (read_input(audio, &skipped, 1) != 1) {
+                break;
+            }
+        }
+    }
+
+    fprintf(stderr, "WAV file has no data\n");
+    return false;
+}
+
+/**
+ * Shifts the window by AUDIO_HOP_SIZE reading the new samples (downmixed to
+ * mono). Returns false when the input is over.
+ */
+static bool read_hop(struct AudioSource *audio) {
+    int16_t *pcm = audio->pcm;
+    size_t frame_size = sizeof(int16_t) * audio->channels;
+    size_t size = read_input(audio, pcm, AUDIO_HOP_SIZE * frame_size);
+    size_t read_samples = size / frame_size;
+    if (read_samples == 0) {
+        return false;
+    }
+
+    float *samples = audio->samples;
+    memmove(samples, samples + AUDIO_HOP_SIZE,
+            sizeof(float) * (AUDIO_FFT_SIZE - AUDIO_HOP_SIZE));
+
+    float *hop = samples + AUDIO_FFT_SIZE - AUDIO_HOP_SIZE;
+    for (size_t i = 0; i < AUDIO_HOP_SIZE; i++) {
+        float sum = 0;
+        for (uint16_t channel = 0; i < read_samples &&
+             channel < audio->channels; channel++)
+        {
+            sum += pcm[i * audio->channels + channel];
+        }
+        hop[i] = sum / (32768.0f * audio->channels);
+    }
+
+    return true;
+}
+
+// --- Analysis ----
+
+static void setup_analysis(struct AudioSource *audio) {
+    for (uint32_t i = 0; i < AUDIO_FFT_SIZE; i++) {
+        audio->window[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / AUDIO_FFT_SIZE);
+    }
+
+    for (uint32_t i = 0; i < AUDIO_FFT_SIZE / 2; i++) {
+        audio->cosines[i] = cosf(2 * M_PI * i / AUDIO_FFT_SIZE);
+        audio->sines[i] = -sinf(2 * M_PI * i / AUDIO_FFT_SIZE);
+    }
+
+    // Log-spaced band edges (in FFT bins), at least one bin per band.
+    float max_frequency = MIN(MAX_FREQUENCY, audio->sample_rate / 2.0f);
+    uint16_t bins = AUDIO_FFT_SIZE / 2;
+    for (uint16_t band = 0; band <= VISUALIZER_BANDS; band++) {
+        float frequency = MIN_FREQUENCY * powf(max_frequency / MIN_FREQUENCY,
+                                               (float)band / VISUALIZER_BANDS);
+        uint16_t bin = lroundf(frequency * AUDIO_FFT_SIZE / audio->sample_rate);
+        if (band > 0) {
+            bin = MAX(bin, audio->band_edges[band - 1] + 1);
+        }
+        audio->band_edges[band] = MIN(bin, bins);
+    }
+
+    audio->peak = MIN_PEAK;
+}
+
+/**
+ * In-place iterative radix-2 FFT of `real` + i * `imaginary`.
+ */
+static void fft(struct AudioSource *audio) {
+    float *real = audio->real, *imaginary = audio->imaginary;
+
+    for (uint32_t i = 1, j = 0; i < AUDIO_FFT_SIZE; i++) {
+        uint32_t bit = AUDIO_FFT_SIZE >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+
+        if (i < j) {
+            float swap = real[i];
+            real[i] = real[j];
+            real[j] = swap;
+
+            swap = imaginary[i];
+            imaginary[i] = imaginary[j];
+            imaginary[j] = swap;
+        }
+    }
+
+    for (uint32_t size = 2; size <= AUDIO_FFT_SIZE; size <<= 1) {
+        uint32_t half = size / 2, stride = AUDIO_FFT_SIZE / size;
+        for (uint32_t start = 0; start < AUDIO_FFT_SIZE; start += size) {
+            for (uint32_t k = 0; k < half; k++) {
+                float wr = audio->cosines[k * stride];
+                float wi = audio->sines[k * stride];
+                uint32_t even = start + k, odd = start + k + half;
+                float tr = real[odd] * wr - imaginary[odd] * wi;
+                float ti = real[odd] * wi + imaginary[odd] * wr;
+                real[odd] = real[even] - tr;
+                imaginary[odd] = imaginary[even] - ti;
+                real[even] += tr;
+                imaginary[even] += ti;
+            }
+        }
+    }
+}
+
+/**
+ * Windows the samples, runs the FFT and updates the normalized bands.
+ */
+static void analyze(struct AudioSource *audio) {
+    for (uint32_t i = 0; i < AUDIO_FFT_SIZE; i++) {
+        audio->real[i] = audio->samples[i] * audio->window[i];
+        audio->imaginary[i] = 0;
+    }
+
+    fft(audio);
+
+    // A full scale sine through a Hann window peaks at AUDIO_FFT_SIZE / 4.
+    float full_scale = AUDIO_FFT_SIZE / 4.0f;
+    float values[VISUALIZER_BANDS], loudest = 0;
+    for (uint16_t band = 0; band < VISUALIZER_BANDS; band++) {
+        float power = 0;
+        uint16_t from = audio->band_edges[band];
+        uint16_t to = audio->band_edges[band + 1];
+        for (uint16_t bin = from; bin < to; bin++) {
+            power += audio->real[bin] * audio->real[bin] +
+                     audio->imaginary[bin] * audio->imaginary[bin];
+        }
+
+        float magnitude = sqrtf(power / MAX(to - from, 1)) / full_scale;
+        float db = 20 * log10f(magnitude + 1e-9f);
+        values[band] = MAX(0, 1 + db / DYNAMIC_RANGE_DB);
+        loudest = MAX(loudest, values[band]);
+    }
+
+    audio->peak = MAX(MAX(loudest, MIN_PEAK), audio->peak * PEAK_DECAY);
+    for (uint16_t band = 0; band < VISUALIZER_BANDS; band++) {
+        float value = MIN(values[band] / audio->peak, 1);
+        audio->bands[band] = MAX(value, audio->bands[band] - BAND_FALLOFF);
+    }
+}
+
+// --- Threads ----
+
+/**
+ * Producer: reads, analyzes and renders one frame per hop into the queue.
+ */
+static void *audio_producer(void *context) {
+    struct AudioSource *audio = context;
+    double period_ms = 1000.0 * AUDIO_HOP_SIZE / audio->sample_rate;
+    double window_ms = 1000.0 * AUDIO_FFT_SIZE / audio->sample_rate;
+    uint64_t period_ns = 1000000ULL * AUDIO_HOP_SIZE * 1000 /
+                         audio->sample_rate;
+
+    uint64_t start = monotonic_ns();
+    uint64_t next_report = start + REPORT_INTERVAL_NS;
+    uint64_t hops = 0;
+
+    while (read_hop(audio)) {
+        // Files are read way faster than real time; hold each hop until the
+        // moment its last sample would have been played.
+        if (audio->paced) {
+            uint64_t due = start + ++hops * period_ns;
+            struct timespec deadline = {
+                .tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                                   NULL) == EINTR);
+        }
+
+        // The hop's first sample was captured (or played, for files) a
+        // period before its last one; buffering the hop is the biggest part
+        // of the latency, so it's measured from there.
+        uint64_t read_at = monotonic_ns();
+        uint64_t captured = read_at - period_ns;
+        analyze(audio);
+
+        struct QueuedFrame *slot = queue_reserve(&audio->queue);
+        if (slot != NULL) {
+            clear_frame(&slot->frame);
+            audio->visualizer->render(&slot->frame, audio->bands);
+            compute_slot_flags(&slot->frame);
+            slot->timestamp = captured;
+            queue_publish(&audio->queue);
+        }
+
+        uint64_t now = monotonic_ns();
+        audio->processing_max = MAX(audio->processing_max, now - read_at);
+        if (now < next_report) {
+            continue;
+        }
+
+        next_report = now + REPORT_INTERVAL_NS;
+        uint32_t count = __atomic_exchange_n(&audio->latency_count, 0,
+                                             __ATOMIC_RELAXED);
+        uint64_t sum = __atomic_exchange_n(&audio->latency_sum, 0,
+                                           __ATOMIC_RELAXED);
+        uint64_t max = __atomic_exchange_n(&audio->latency_max, 0,
+                                           __ATOMIC_RELAXED);
+        // Buffering alone takes a frame period, so it's what comes on top
+        // of it that has to fit in one.
+        printf("Audio: %u frames, latency avg %.2f ms max %.2f ms (%.2f ms "
+               "of hop buffering, %.2f ms window), processing max %.2f ms, "
+               "%u dropped%s\n", count, count ? sum / 1e6 / count : 0,
+               max / 1e6, period_ms, window_ms, audio->processing_max / 1e6,
+               audio->queue.dropped, max / 1e6 >= 2 * period_ms ?
+               " [LATENCY OVER FRAME PERIOD AFTER BUFFERING]" : "");
+        fflush(stdout);
+        audio->processing_max = 0;
+    }
+
+    printf("Audio input is over\n");
+    __atomic_store_n(&audio->finished, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Consumer (refresh loop): shows the newest frame and accounts its latency.
+ */
+static struct Frame *audio_poll(void *context) {
+    struct AudioSource *audio = context;
+    if (__atomic_load_n(&audio->finished, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    bool fresh;
+    struct QueuedFrame *latest = queue_latest(&audio->queue, &fresh);
+    if (fresh) {
+        uint64_t latency = monotonic_ns() - latest->timestamp;
+        __atomic_add_fetch(&audio->latency_sum, latency, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&audio->latency_count, 1, __ATOMIC_RELAXED);
+        if (latency > __atomic_load_n(&audio->latency_max, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&audio->latency_max, latency, __ATOMIC_RELAXED);
+        }
+    }
+
+    return latest == NULL ? NULL : &latest->frame;
+}
+
+// --- Exposed functions ----
+
+/**
+ * Starts the audio-reactive live mode: a producer thread reads PCM from the
+ * given path (a WAV file, a raw s16le pipe, or "-" for stdin), runs a
+ * windowed FFT every AUDIO_HOP_SIZE samples and renders the spectrum with
+ * the given visualizer into a lock-free frame queue. Latency from the first
+ * sample of every hop to its frame being displayed, which includes the
+ * hop's buffering, is reported periodically on stdout.
+ *
+ * - parameter path:       The PCM source.
+ * - parameter visualizer: The name of the visualizer (see visualizers.c).
+ * - parameter source:     A pointer that will be configured as the refresh
+ *                         loop's live source of frames.
+ */
+bool start_audio(const char *path, const char *visualizer,
+                 struct Source *source)
+{
+    struct AudioSource *audio = calloc(1, sizeof(struct AudioSource));
+    audio->visualizer = find_visualizer(visualizer);
+    if (audio->visualizer == NULL) {
+        fprintf(stderr, "Unknown visualizer %s\n", visualizer);
+        free(audio);
+        return false;
+    }
+
+    audio->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (audio->fd < 0) {
+        fprintf(stderr, "Can't open audio source %s\n", path);
+        free(audio);
+        return false;
+    }
+
+    struct stat stats;
+    audio->paced = fstat(audio->fd, &stats) == 0 && S_ISREG(stats.st_mode);
+    if (!read_header(audio)) {
+        close(audio->fd);
+        free(audio);
+        return false;
+    }
+
+    setup_analysis(audio);
+
+    // The refresh loop runs with SCHED_FIFO; the producer must not inherit it
+    // or it would compete with the multiplexing.
+    pthread_attr_t attributes;
+    struct sched_param parameters = {.sched_priority = 0};
+    pthread_attr_init(&attributes);
+    pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attributes, SCHED_OTHER);
+    pthread_attr_setschedparam(&attributes, &parameters);
+
+    int error = pthread_create(&audio->thread, &attributes, audio_producer,
+                               audio);
+    pthread_attr_destroy(&attributes);
+    if (error != 0) {
+        fprintf(stderr, "Can't start audio thread (%s)\n", strerror(error));
+        close(audio->fd);
+        free(audio);
+        return false;
+    }
+
+    printf("Audio source %s: %u Hz, %u channels, visualizer %s\n", path,
+           audio->sample_rate, audio->channels, visualizer);
+
+    source->poll = audio_poll;
+    source->context = audio;
+    return true;
+}
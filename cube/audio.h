@@ -0,0 +1,34 @@
+#ifndef _AUDIOH_
+#define _AUDIOH_
+
+#include "animation.h"
+
+/// Samples per FFT window and samples between consecutive windows (one cube
+/// frame is produced per hop: ~23ms at 44.1kHz).
+#define AUDIO_FFT_SIZE      2048
+#define AUDIO_HOP_SIZE      1024
+
+/// Format assumed for raw (headerless) PCM: signed 16 bits, little endian.
+#define AUDIO_RAW_RATE      44100
+#define AUDIO_RAW_CHANNELS  1
+
+/// WAV files with more channels than this (e.g. 7.1) are rejected.
+#define AUDIO_MAX_CHANNELS  8
+
+/**
+ * Starts the audio-reactive live mode: a producer thread reads PCM from the
+ * given path (a WAV file, a raw s16le pipe, or "-" for stdin), runs a
+ * windowed FFT every AUDIO_HOP_SIZE samples and renders the spectrum with
+ * the given visualizer into a lock-free frame queue. Latency from the first
+ * sample of every hop to its frame being displayed, which includes the
+ * hop's buffering, is reported periodically on stdout.
+ *
+ * - parameter path:       The PCM source.
+ * - parameter visualizer: The name of the visualizer (see visualizers.c).
+ * - parameter source:     A pointer that will be configured as the refresh
+ *                         loop's live source of frames.
+ */
+bool start_audio(const char *path, const char *visualizer,
+                 struct Source *source);
+
+#endif
@@ -0,0 +1,117 @@
+#include "framebuffer.h"
+#include "../voxels.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+/**
+ * Maps the framebuffer of the running lyftcube. Returns NULL (and prints why)
+ * when it's not running.
+ */
+struct Framebuffer *open_framebuffer(void) {
+    int fd = shm_open(FRAMEBUFFER_NAME, O_RDWR, 0);
+    if (fd < 0) {
+        fprintf(stderr, "No shared framebuffer %s (is lyftcube running?)\n",
+                FRAMEBUFFER_NAME);
+        return NULL;
+    }
+
+    struct SharedFramebuffer *shared = mmap(NULL,
+        sizeof(struct SharedFramebuffer), PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Can't map shared framebuffer %s\n", FRAMEBUFFER_NAME);
+        return NULL;
+    }
+
+    uint32_t magic = __atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE);
+    if (magic != FRAMEBUFFER_MAGIC) {
+        fprintf(stderr, "Shared framebuffer %s isn't initialized\n",
+                FRAMEBUFFER_NAME);
+        munmap(shared, sizeof(struct SharedFramebuffer));
+        return NULL;
+    }
+
+    struct Framebuffer *framebuffer = calloc(1, sizeof(struct Framebuffer));
+    framebuffer->shared = shared;
+    return framebuffer;
+}
+
+/**
+ * Unmaps the framebuffer. The cube goes back to its animation once no frames
+ * are committed for FRAMEBUFFER_IDLE_NS.
+ *
+ * - parameter framebuffer: The framebuffer returned by `open_framebuffer`.
+ */
+void close_framebuffer(struct Framebuffer *framebuffer) {
+    munmap(framebuffer->shared, sizeof(struct SharedFramebuffer));
+    free(framebuffer);
+}
+
+/**
+ * Starts drawing a new frame. It's drawn in place into a buffer that holds
+ * an older frame, so clear it first or set every LED.
+ *
+ * - parameter framebuffer: The framebuffer.
+ */
+void begin_frame(struct Framebuffer *framebuffer) {
+    struct SharedFramebuffer *shared = framebuffer->shared;
+    uint32_t drawing = __atomic_load_n(&shared->drawing, __ATOMIC_RELAXED);
+    framebuffer->back = &shared->buffers[drawing % 3];
+}
+
+/**
+ * Sets all the LEDs of the frame being drawn to off.
+ *
+ * - parameter framebuffer: The framebuffer.
+ */
+void clear_framebuffer(struct Framebuffer *framebuffer) {
+    clear_frame(framebuffer->back);
+}
+
+/**
+ * Sets the LED at the given position of the frame being drawn to the given
+ * color, converted the same way GIF pixels are (see `set_color_led` in
+ * ../voxels.h). Out of range positions are clamped to the cube.
+ *
+ * - parameter framebuffer: The framebuffer.
+ * - parameter level:       The level on the LED cube (0-7) from bottom to top.
+ * - parameter row:         The y coordinate of the 2-D level (0-7).
+ * - parameter column:      The x coordinate of the 2-D level (0-7).
+ * - parameter red:         The red component (0-255).
+ * - parameter green:       The green component (0-255).
+ * - parameter blue:        The blue component (0-255).
+ */
+void set_framebuffer_led(struct Framebuffer *framebuffer, int level, int row,
+                         int column, uint8_t red, uint8_t green,
+                         uint8_t blue)
+{
+    set_color_led(framebuffer->back, MAX(MIN(level, 7), 0),
+                  MAX(MIN(row, 7), 0), MAX(MIN(column, 7), 0), red, green,
+                  blue);
+}
+
+/**
+ * Publishes the frame being drawn; lyftcube shows it from the next BAM cycle.
+ *
+ * - parameter framebuffer: The framebuffer.
+ */
+void commit_frame(struct Framebuffer *framebuffer) {
+    struct SharedFramebuffer *shared = framebuffer->shared;
+    uint32_t drawing = __atomic_load_n(&shared->drawing, __ATOMIC_RELAXED);
+
+    // The frame becomes the ready one and the buffer it replaces (taken or
+    // not) is drawn next.
+    uint32_t ready = __atomic_exchange_n(&shared->ready,
+                                         drawing | FRAMEBUFFER_FRESH,
+                                         __ATOMIC_ACQ_REL);
+    __atomic_store_n(&shared->drawing, ready & ~FRAMEBUFFER_FRESH,
+                     __ATOMIC_RELAXED);
+}
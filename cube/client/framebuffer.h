@@ -0,0 +1,81 @@
+#ifndef _CLIENT_FRAMEBUFFERH_
+#define _CLIENT_FRAMEBUFFERH_
+
+#include "../framebuffer.h"
+
+/**
+ * A connection to the shared framebuffer of a running lyftcube. Drawing is
+ * modeled on the CubeDesigner helpers:
+ *
+ *     struct Framebuffer *framebuffer = open_framebuffer();
+ *     while (...) {
+ *         begin_frame(framebuffer);
+ *         clear_framebuffer(framebuffer);
+ *         set_framebuffer_led(framebuffer, level, row, column, red, green,
+ *                             blue);
+ *         ...
+ *         commit_frame(framebuffer);
+ *     }
+ *
+ * None of these calls enter the kernel or copy frames. Only one producer may
+ * draw at a time. Link with liblyftcube.a (make), -lm and -lrt.
+ */
+struct Framebuffer {
+    struct SharedFramebuffer *shared;
+    struct Frame *back;
+};
+
+/**
+ * Maps the framebuffer of the running lyftcube. Returns NULL (and prints why)
+ * when it's not running.
+ */
+struct Framebuffer *open_framebuffer(void);
+
+/**
+ * Unmaps the framebuffer. The cube goes back to its animation once no frames
+ * are committed for FRAMEBUFFER_IDLE_NS.
+ *
+ * - parameter framebuffer: The framebuffer returned by `open_framebuffer`.
+ */
+void close_framebuffer(struct Framebuffer *framebuffer);
+
+/**
+ * Starts drawing a new frame. It's drawn in place into a buffer that holds
+ * an older frame, so clear it first or set every LED.
+ *
+ * - parameter framebuffer: The framebuffer.
+ */
+void begin_frame(struct Framebuffer *framebuffer);
+
+/**
+ * Sets all the LEDs of the frame being drawn to off.
+ *
+ * - parameter framebuffer: The framebuffer.
+ */
+void clear_framebuffer(struct Framebuffer *framebuffer);
+
+/**
+ * Sets the LED at the given position of the frame being drawn to the given
+ * color, converted the same way GIF pixels are (see `set_color_led` in
+ * ../voxels.h). Out of range positions are clamped to the cube.
+ *
+ * - parameter framebuffer: The framebuffer.
+ * - parameter level:       The level on the LED cube (0-7) from bottom to top.
+ * - parameter row:         The y coordinate of the 2-D level (0-7).
+ * - parameter column:      The x coordinate of the 2-D level (0-7).
+ * - parameter red:         The red component (0-255).
+ * - parameter green:       The green component (0-255).
+ * - parameter blue:        The blue component (0-255).
+ */
+void set_framebuffer_led(struct Framebuffer *framebuffer, int level, int row,
+                         int column, uint8_t red, uint8_t green,
+                         uint8_t blue);
+
+/**
+ * Publishes the frame being drawn; lyftcube shows it from the next BAM cycle.
+ *
+ * - parameter framebuffer: The framebuffer.
+ */
+void commit_frame(struct Framebuffer *framebuffer);
+
+#endif
@@ -0,0 +1,115 @@
+#include "framebuffer.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct FramebufferSource {
+    struct SharedFramebuffer *shared;
+
+    // The buffer shown, owned by lyftcube until it takes a fresher one.
+    uint32_t showing;
+    bool live;
+
+    uint64_t updated;
+    uint32_t frames;
+};
+
+// --- Consumer ----
+
+/**
+ * Consumer (refresh loop): shows the newest committed frame, or nothing when
+ * producers are idle.
+ */
+static struct Frame *framebuffer_poll(void *context) {
+    struct FramebufferSource *framebuffer = context;
+    struct SharedFramebuffer *shared = framebuffer->shared;
+    uint64_t now = monotonic_ns();
+
+    // The shown buffer goes back to the producer in exchange for the fresh
+    // one, which is always a different buffer (and pointer).
+    if (__atomic_load_n(&shared->ready, __ATOMIC_RELAXED) & FRAMEBUFFER_FRESH)
+    {
+        uint32_t ready = __atomic_exchange_n(&shared->ready,
+                                             framebuffer->showing,
+                                             __ATOMIC_ACQ_REL);
+        framebuffer->showing = ready & ~FRAMEBUFFER_FRESH;
+        compute_slot_flags(&shared->buffers[framebuffer->showing]);
+
+        if (!framebuffer->live) {
+            printf("Framebuffer: showing frames from a local producer\n");
+        }
+
+        framebuffer->updated = now;
+        framebuffer->live = true;
+        framebuffer->frames++;
+    }
+
+    if (framebuffer->live && now - framebuffer->updated > FRAMEBUFFER_IDLE_NS) {
+        printf("Framebuffer: producer idle (%u frames shown)\n",
+               framebuffer->frames);
+        framebuffer->live = false;
+        framebuffer->frames = 0;
+    }
+
+    return framebuffer->live ? &shared->buffers[framebuffer->showing] : NULL;
+}
+
+// --- Exposed functions ----
+
+/**
+ * Creates (or resets) the shared framebuffer, which only users in
+ * lyftcube's group can draw into, and configures a live source that shows
+ * what producers commit to it.
+ *
+ * - parameter source: A pointer that will be configured as the refresh
+ *                     loop's live source of frames.
+ */
+bool start_framebuffer(struct Source *source) {
+    int fd = shm_open(FRAMEBUFFER_NAME, O_RDWR | O_CREAT, 0660);
+    if (fd < 0) {
+        fprintf(stderr, "Can't create shared framebuffer %s\n",
+                FRAMEBUFFER_NAME);
+        return false;
+    }
+
+    // Producers run as regular users added to lyftcube's group (the
+    // binary is setgid); the umask could have narrowed the mode.
+    fchmod(fd, 0660);
+    if (ftruncate(fd, sizeof(struct SharedFramebuffer)) != 0) {
+        fprintf(stderr, "Can't size shared framebuffer %s\n",
+                FRAMEBUFFER_NAME);
+        close(fd);
+        return false;
+    }
+
+    struct SharedFramebuffer *shared = mmap(NULL,
+        sizeof(struct SharedFramebuffer), PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Can't map shared framebuffer %s\n", FRAMEBUFFER_NAME);
+        return false;
+    }
+
+    // Frames left by a previous run are stale. The producer draws into the
+    // first buffer, the second one is ready (but not fresh) and lyftcube
+    // owns the third.
+    memset(shared, 0, sizeof(struct SharedFramebuffer));
+    shared->ready = 1;
+    shared->drawing = 0;
+    __atomic_store_n(&shared->magic, FRAMEBUFFER_MAGIC, __ATOMIC_RELEASE);
+
+    struct FramebufferSource *framebuffer =
+        calloc(1, sizeof(struct FramebufferSource));
+    framebuffer->shared = shared;
+    framebuffer->showing = 2;
+
+    source->poll = framebuffer_poll;
+    source->context = framebuffer;
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef _FRAMEBUFFERH_
+#define _FRAMEBUFFERH_
+
+#include "animation.h"
+
+/// POSIX shared memory object (/dev/shm/lyftcube) local producers draw into.
+#define FRAMEBUFFER_NAME    "/lyftcube"
+#define FRAMEBUFFER_MAGIC   0x4c594634
+
+/// Set on `ready` when its buffer was committed and lyftcube hasn't taken
+/// it yet.
+#define FRAMEBUFFER_FRESH   0x80000000
+
+/// When producers stop committing frames for this long the cube goes back
+/// to the current animation.
+#define FRAMEBUFFER_IDLE_NS 5000000000ULL
+
+/**
+ * Layout of the shared framebuffer (host endianness, no padding):
+ *
+ * - `magic`:    FRAMEBUFFER_MAGIC (which changes along with the layout)
+ *               once lyftcube has initialized the memory.
+ * - `ready`:    The index of the newest committed buffer, with
+ *               FRAMEBUFFER_FRESH until lyftcube takes it.
+ * - `drawing`:  The index of the buffer the producer draws into.
+ * - `buffers`:  Three frames; only the bit planes (`cube`) are drawn.
+ *
+ * The buffers are triple buffered, so frames are never copied: at any time
+ * one is being drawn, one is shown by lyftcube and one is ready for it. The
+ * producer commits by exchanging `drawing` with `ready` (setting
+ * FRAMEBUFFER_FRESH), and lyftcube takes a fresh frame on a BAM cycle
+ * boundary by exchanging the one it shows with `ready`. Neither waits for
+ * the other nor enters the kernel, and no buffer is ever written while it
+ * is shown. There must be a single producer at a time.
+ */
+struct SharedFramebuffer {
+    uint32_t magic;
+    uint32_t ready;
+    uint32_t drawing;
+    uint32_t reserved;
+    struct Frame buffers[3];
+};
+
+/**
+ * Creates (or resets) the shared framebuffer, which only users in
+ * lyftcube's group can draw into, and configures a live source that shows
+ * what producers commit to it.
+ *
+ * - parameter source: A pointer that will be configured as the refresh
+ *                     loop's live source of frames.
+ */
+bool start_framebuffer(struct Source *source);
+
+#endif
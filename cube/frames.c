@@ -0,0 +1,139 @@
+#include "frames.h"
+
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct FramesHeader {
+    char magic[4];
+    uint8_t bits;
+    uint8_t reserved[3];
+    uint32_t frames_count;
+};
+
+/**
+ * Returns the path of the converted frames of the given animation, stored on
+ * the given buffer, or NULL if the path is too long.
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ * - parameter path:     A buffer of PATH_MAX bytes for the path.
+ */
+char *frames_path(const char *gif_path, char *path) {
+    size_t length = strlen(gif_path);
+    if (length < 4 || length - 4 + strlen(FRAMES_EXTENSION) >= PATH_MAX) {
+        return NULL;
+    }
+
+    memcpy(path, gif_path, length - 4);
+    strcpy(path + length - 4, FRAMES_EXTENSION);
+    return path;
+}
+
+/**
+ * Stores the frames of the animation (only their bit planes and durations)
+ * next to its GIF. The file is replaced atomically so lyftcube never reads a
+ * partial one.
+ *
+ * - parameter gif_path:  The path of the animation's GIF file.
+ * - parameter animation: The animation, with a single phase per frame.
+ */
+bool save_frames(const char *gif_path, struct Animation *animation) {
+    char buffer[PATH_MAX], temporary[PATH_MAX + 4];
+    char *path = frames_path(gif_path, buffer);
+    if (path == NULL) {
+        return false;
+    }
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Can't create %s\n", temporary);
+        return false;
+    }
+
+    struct FramesHeader header = {
+        .magic = FRAMES_MAGIC, .bits = BAM_BITS,
+        .frames_count = animation->frames_count
+    };
+
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (uint32_t i = 0; success && i < animation->frames_count; i++) {
+        struct Frame *frame = &animation->frames[i];
+        success = fwrite(&frame->duration, sizeof(frame->duration), 1,
+                         file) == 1 &&
+                  fwrite(frame->cube, sizeof(frame->cube), 1, file) == 1;
+    }
+
+    success &= fclose(file) == 0;
+    if (!success || rename(temporary, path) != 0) {
+        fprintf(stderr, "Can't write %s\n", path);
+        remove(temporary);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Loads the converted frames of the given animation when they exist and are
+ * at least as new as its GIF, or when its GIF isn't written yet (the server
+ * plays raw uploads before writing their GIF).
+ *
+ * - parameter gif_path:  The path of the animation's GIF file.
+ * - parameter animation: The pointer where the loaded animation will be
+ *                        stored.
+ */
+bool load_frames(const char *gif_path, struct Animation *animation) {
+    struct stat gif_stats, frames_stats;
+    char buffer[PATH_MAX];
+    char *path = frames_path(gif_path, buffer);
+    if (path == NULL || stat(path, &frames_stats) != 0 ||
+        (stat(gif_path, &gif_stats) == 0 &&
+         frames_stats.st_mtime < gif_stats.st_mtime))
+    {
+        return false;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    // The count is checked before it's multiplied: size_t is 32 bits on the
+    // Pi and a bogus count would wrap around.
+    struct FramesHeader header;
+    size_t frame_size = sizeof(uint32_t) + sizeof(LEDCube);
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, FRAMES_MAGIC, sizeof(header.magic)) != 0 ||
+        header.bits != BAM_BITS || header.frames_count == 0 ||
+        header.frames_count > (SIZE_MAX - sizeof(header)) / frame_size ||
+        header.frames_count > SIZE_MAX / sizeof(struct Frame) ||
+        frames_stats.st_size != sizeof(header) +
+                                header.frames_count * frame_size)
+    {
+        fprintf(stderr, "Invalid frames file %s\n", path);
+        fclose(file);
+        return false;
+    }
+
+    struct Frame *frames = calloc(header.frames_count, sizeof(struct Frame));
+    bool success = frames != NULL;
+    for (uint32_t i = 0; success && i < header.frames_count; i++) {
+        success = fread(&frames[i].duration, sizeof(uint32_t), 1, file) == 1 &&
+                  fread(frames[i].cube, sizeof(LEDCube), 1, file) == 1;
+    }
+
+    fclose(file);
+    if (!success) {
+        free(frames);
+        return false;
+    }
+
+    animation->frames = frames;
+    animation->frames_count = header.frames_count;
+    animation->phases = 1;
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef _FRAMESH_
+#define _FRAMESH_
+
+#include "animation.h"
+
+/**
+ * Animations converted ahead of time (the server does it for raw uploads)
+ * are stored next to their GIF as <name>.frames so lyftcube can load the bit
+ * planes directly instead of decoding the GIF. The file holds FRAMES_MAGIC,
+ * BAM_BITS (1 byte), 3 reserved bytes and the number of frames (uint32, host
+ * endianness) followed by every frame as its duration (uint32, milliseconds)
+ * and its bit planes (LEDCube). Files with durations in centiseconds (magic
+ * "LCFR") are ignored.
+ */
+#define FRAMES_MAGIC        "LCF2"
+#define FRAMES_EXTENSION    ".frames"
+
+/**
+ * Returns the path of the converted frames of the given animation, stored on
+ * the given buffer, or NULL if the path is too long.
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ * - parameter path:     A buffer of PATH_MAX bytes for the path.
+ */
+char *frames_path(const char *gif_path, char *path);
+
+/**
+ * Stores the frames of the animation (only their bit planes and durations)
+ * next to its GIF. The file is replaced atomically so lyftcube never reads a
+ * partial one.
+ *
+ * - parameter gif_path:  The path of the animation's GIF file.
+ * - parameter animation: The animation, with a single phase per frame.
+ */
+bool save_frames(const char *gif_path, struct Animation *animation);
+
+/**
+ * Loads the converted frames of the given animation when they exist and are
+ * at least as new as its GIF, or when its GIF isn't written yet (the server
+ * plays raw uploads before writing their GIF).
+ *
+ * - parameter gif_path:  The path of the animation's GIF file.
+ * - parameter animation: The pointer where the loaded animation will be
+ *                        stored.
+ */
+bool load_frames(const char *gif_path, struct Animation *animation);
+
+#endif
@@ -0,0 +1,181 @@
+#include "interpolation.h"
+#include "voxels.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+/**
+ * Decodes the brightness (0-15) of the given LED and color from the frame's
+ * bit planes.
+ */
+static uint8_t brightness(struct Frame *frame, uint8_t level, uint8_t row,
+                          uint8_t column, uint8_t color)
+{
+    uint8_t value = 0;
+    for (uint8_t bit = 0; bit < BAM_BITS; bit++) {
+        uint8_t plane = frame->cube[bit][level][row + color * 8];
+        value |= ((plane >> column) & 1) << bit;
+    }
+
+    return value;
+}
+
+/**
+ * Finds the LEDs that differ between the two keyframes and how much they
+ * change on every step.
+ */
+static void setup_fades(struct Interpolator *interpolator, struct Frame *from,
+                        struct Frame *to)
+{
+    interpolator->from = from;
+    interpolator->to = to;
+    interpolator->step = 0;
+    interpolator->fades_count = 0;
+
+    for (uint8_t level = 0; level < 8; level++) {
+        for (uint8_t row = 0; row < 8; row++) {
+            // Skip rows that are identical on every plane.
+            bool same = true;
+            for (uint8_t bit = 0; same && bit < BAM_BITS; bit++) {
+                for (uint8_t color = 0; color < 3; color++) {
+                    uint8_t index = row + color * 8;
+                    same &= from->cube[bit][level][index] ==
+                            to->cube[bit][level][index];
+                }
+            }
+
+            for (uint8_t column = 0; !same && column < 8; column++) {
+                struct Fade *fade =
+                    &interpolator->fades[interpolator->fades_count];
+                bool changes = false;
+                for (uint8_t color = 0; color < 3; color++) {
+                    int16_t start = brightness(from, level, row, column,
+                                               color);
+                    int16_t end = brightness(to, level, row, column, color);
+                    fade->value[color] = start << 8;
+                    fade->delta[color] = (end - start) * 256 /
+                                         INTERPOLATION_STEPS;
+                    changes |= start != end;
+                }
+
+                if (changes) {
+                    fade->level = level;
+                    fade->row = row;
+                    fade->column = column;
+                    interpolator->fades_count++;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Advances the fades to the given step and encodes them on top of the
+ * previous blend.
+ */
+static void blend(struct Interpolator *interpolator, uint8_t step) {
+    struct Frame *previous = interpolator->step == 0 ? interpolator->from :
+        &interpolator->output[interpolator->output_index];
+
+    interpolator->output_index ^= 1;
+    struct Frame *output = &interpolator->output[interpolator->output_index];
+    memcpy(output->cube, previous->cube, sizeof(output->cube));
+
+    int16_t steps = step - interpolator->step;
+    for (uint16_t i = 0; i < interpolator->fades_count; i++) {
+        struct Fade *fade = &interpolator->fades[i];
+        uint8_t color[3];
+        for (uint8_t c = 0; c < 3; c++) {
+            fade->value[c] += fade->delta[c] * steps;
+            color[c] = (fade->value[c] + 128) >> 8;
+        }
+
+        set_led(output, fade->level, fade->row, fade->column, color[0],
+                color[1], color[2]);
+    }
+
+    compute_slot_flags(output);
+    interpolator->step = step;
+}
+
+// --- Exposed functions ----
+
+/**
+ * Returns the frame to show `elapsed` nanoseconds into a keyframe that lasts
+ * `duration`, blending it into the next keyframe.
+ *
+ * - parameter interpolator: The interpolator.
+ * - parameter from:         The keyframe being played.
+ * - parameter to:           The keyframe that comes next.
+ * - parameter elapsed:      Time since `from` started, in nanoseconds.
+ * - parameter duration:     How long `from` is played, in nanoseconds.
+ */
+struct Frame *interpolate(struct Interpolator *interpolator,
+                          struct Frame *from, struct Frame *to,
+                          uint64_t elapsed, uint64_t duration)
+{
+    uint64_t start = monotonic_ns();
+    bool worked = false;
+    if (from != interpolator->from || to != interpolator->to) {
+        setup_fades(interpolator, from, to);
+        interpolator->keyframes++;
+        worked = true;
+    }
+
+    // The last step is `to` itself, which is shown as the next keyframe.
+    uint8_t step = MIN(elapsed * INTERPOLATION_STEPS / duration,
+                       INTERPOLATION_STEPS - 1);
+    if (interpolator->fades_count > 0 && step > interpolator->step) {
+        blend(interpolator, step);
+        interpolator->blends++;
+        worked = true;
+    }
+
+    if (worked) {
+        uint64_t cost = monotonic_ns() - start;
+        interpolator->total_ns += cost;
+        if (cost > interpolator->max_ns) {
+            interpolator->max_ns = cost;
+        }
+    }
+
+    return interpolator->step == 0 ? from :
+           &interpolator->output[interpolator->output_index];
+}
+
+/**
+ * Forgets the keyframes being blended (e.g. because they were freed).
+ *
+ * - parameter interpolator: The interpolator.
+ */
+void reset_interpolation(struct Interpolator *interpolator) {
+    interpolator->from = NULL;
+    interpolator->to = NULL;
+    interpolator->step = 0;
+}
+
+/**
+ * Prints how many keyframes were blended and their CPU cost, then resets the
+ * counters.
+ *
+ * - parameter interpolator: The interpolator.
+ */
+void print_interpolation_stats(struct Interpolator *interpolator) {
+    if (interpolator->keyframes == 0) {
+        return;
+    }
+
+    printf("Interpolation: %llu keyframes, %llu blends, avg %.1f us of CPU "
+           "per keyframe, max %.1f us per cycle\n",
+           (unsigned long long)interpolator->keyframes,
+           (unsigned long long)interpolator->blends,
+           interpolator->total_ns / 1e3 / interpolator->keyframes,
+           interpolator->max_ns / 1e3);
+
+    interpolator->keyframes = 0;
+    interpolator->blends = 0;
+    interpolator->total_ns = 0;
+    interpolator->max_ns = 0;
+}
@@ -0,0 +1,76 @@
+#ifndef _INTERPOLATIONH_
+#define _INTERPOLATIONH_
+
+#include "animation.h"
+
+/// Number of blends shown while a keyframe fades into the next one. With 4
+/// bits per color the difference between two frames is at most 15 levels,
+/// so 16 steps already show every intermediate brightness.
+#define INTERPOLATION_STEPS     16
+
+#define LEDS_COUNT              (8 * 8 * 8)
+
+/**
+ * An LED that differs between the two keyframes being blended. Brightness is
+ * in 8.8 fixed point and advances by `delta` on every step.
+ */
+struct Fade {
+    uint8_t level, row, column;
+    int16_t value[3];
+    int16_t delta[3];
+};
+
+/**
+ * Blends consecutive keyframes while the refresh loop plays them. Only the
+ * LEDs that change between the pair are tracked and every step just adds
+ * their deltas, re-encodes them into a copy of the previous blend and
+ * computes the slot flags. Blends alternate between two buffers so the
+ * displayed frame is never modified.
+ */
+struct Interpolator {
+    struct Frame *from, *to;
+    struct Fade fades[LEDS_COUNT];
+    uint16_t fades_count;
+    uint8_t step;
+
+    struct Frame output[2];
+    uint8_t output_index;
+
+    // Cost of the keyframe setups and blends since the last
+    // `print_interpolation_stats`.
+    uint64_t keyframes;
+    uint64_t blends;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/**
+ * Returns the frame to show `elapsed` nanoseconds into a keyframe that lasts
+ * `duration`, blending it into the next keyframe.
+ *
+ * - parameter interpolator: The interpolator.
+ * - parameter from:         The keyframe being played.
+ * - parameter to:           The keyframe that comes next.
+ * - parameter elapsed:      Time since `from` started, in nanoseconds.
+ * - parameter duration:     How long `from` is played, in nanoseconds.
+ */
+struct Frame *interpolate(struct Interpolator *interpolator,
+                          struct Frame *from, struct Frame *to,
+                          uint64_t elapsed, uint64_t duration);
+
+/**
+ * Forgets the keyframes being blended (e.g. because they were freed).
+ *
+ * - parameter interpolator: The interpolator.
+ */
+void reset_interpolation(struct Interpolator *interpolator);
+
+/**
+ * Prints how many keyframes were blended and their CPU cost, then resets the
+ * counters.
+ *
+ * - parameter interpolator: The interpolator.
+ */
+void print_interpolation_stats(struct Interpolator *interpolator);
+
+#endif
@@ -0,0 +1,393 @@
+#include "layers.h"
+#include "parser.h"
+#include "voxels.h"
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+#define FONT_FIRST      ' '
+#define FONT_LAST       'Z'
+#define FONT_WIDTH      5
+#define FONT_SPACING    1
+
+/// Bit planes are processed a word at a time; bytes and words alias.
+typedef uint32_t __attribute__((may_alias)) PlaneWord;
+
+/// 5x7 font from ' ' to 'Z', one byte per column with the top row on the
+/// least significant bit. Lowercase letters are drawn uppercase.
+static const uint8_t font[FONT_LAST - FONT_FIRST + 1][FONT_WIDTH] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5f, 0x00, 0x00},
+    {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7f, 0x14, 0x7f, 0x14},
+    {0x24, 0x2a, 0x7f, 0x2a, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62},
+    {0x36, 0x49, 0x56, 0x20, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00},
+    {0x00, 0x1c, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1c, 0x00},
+    {0x14, 0x08, 0x3e, 0x08, 0x14}, {0x08, 0x08, 0x3e, 0x08, 0x08},
+    {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08},
+    {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},
+    {0x3e, 0x51, 0x49, 0x45, 0x3e}, {0x00, 0x42, 0x7f, 0x40, 0x00},
+    {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4b, 0x31},
+    {0x18, 0x14, 0x12, 0x7f, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39},
+    {0x3c, 0x4a, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+    {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1e},
+    {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},
+    {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14},
+    {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},
+    {0x32, 0x49, 0x79, 0x41, 0x3e}, {0x7e, 0x11, 0x11, 0x11, 0x7e},
+    {0x7f, 0x49, 0x49, 0x49, 0x36}, {0x3e, 0x41, 0x41, 0x41, 0x22},
+    {0x7f, 0x41, 0x41, 0x22, 0x1c}, {0x7f, 0x49, 0x49, 0x49, 0x41},
+    {0x7f, 0x09, 0x09, 0x09, 0x01}, {0x3e, 0x41, 0x49, 0x49, 0x7a},
+    {0x7f, 0x08, 0x08, 0x08, 0x7f}, {0x00, 0x41, 0x7f, 0x41, 0x00},
+    {0x20, 0x40, 0x41, 0x3f, 0x01}, {0x7f, 0x08, 0x14, 0x22, 0x41},
+    {0x7f, 0x40, 0x40, 0x40, 0x40}, {0x7f, 0x02, 0x0c, 0x02, 0x7f},
+    {0x7f, 0x04, 0x08, 0x10, 0x7f}, {0x3e, 0x41, 0x41, 0x41, 0x3e},
+    {0x7f, 0x09, 0x09, 0x09, 0x06}, {0x3e, 0x41, 0x51, 0x21, 0x5e},
+    {0x7f, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},
+    {0x01, 0x01, 0x7f, 0x01, 0x01}, {0x3f, 0x40, 0x40, 0x40, 0x3f},
+    {0x1f, 0x20, 0x40, 0x20, 0x1f}, {0x3f, 0x40, 0x38, 0x40, 0x3f},
+    {0x63, 0x14, 0x08, 0x14, 0x63}, {0x07, 0x08, 0x70, 0x08, 0x07},
+    {0x61, 0x51, 0x49, 0x45, 0x43},
+};
+
+/// Posted by `reload_overlays` (sem_post is async-signal-safe).
+static sem_t reload_requested;
+
+// --- Layers ----
+
+/**
+ * Returns the font column `index` of the message (spacing included).
+ */
+static uint8_t text_column(const char *text, size_t length, int32_t index) {
+    int32_t character = index / (FONT_WIDTH + FONT_SPACING);
+    int32_t column = index % (FONT_WIDTH + FONT_SPACING);
+    if (index < 0 || character >= (int32_t)length || column >= FONT_WIDTH) {
+        return 0;
+    }
+
+    char value = text[character];
+    if (value >= 'a' && value <= 'z') {
+        value -= 'a' - 'A';
+    }
+
+    if (value < FONT_FIRST || value > FONT_LAST) {
+        value = ' ';
+    }
+
+    return font[value - FONT_FIRST][column];
+}
+
+static void light(struct Layer *layer, uint8_t level, uint8_t row,
+                  uint8_t column)
+{
+    set_led(&layer->content, level, row, column, layer->red, layer->green,
+            layer->blue);
+    layer->mask[level].rows[row] |= 1 << column;
+}
+
+/**
+ * Renders the layer for the given time. Returns false when it looks the same
+ * as the last time it was rendered.
+ */
+static bool render_layer(struct Layer *layer, uint64_t elapsed_ns) {
+    int64_t state = 0;
+    size_t length = strlen(layer->text);
+    int32_t columns = length * (FONT_WIDTH + FONT_SPACING);
+
+    switch (layer->type) {
+        // The message enters from the right and leaves through the left.
+        case LAYER_TEXT:
+            state = (int64_t)(elapsed_ns / 1e9 * layer->speed) %
+                    (columns + 8);
+            break;
+
+        case LAYER_STATUS:
+            state = layer->blink_ms == 0 ? 1 :
+                    (elapsed_ns / 1000000 / layer->blink_ms) % 2 == 0;
+            break;
+    }
+
+    if (state == layer->state) {
+        return false;
+    }
+
+    layer->state = state;
+    clear_frame(&layer->content);
+    memset(layer->mask, 0, sizeof(layer->mask));
+
+    switch (layer->type) {
+        // Front face (row 0); the 7 font rows go from the top level down.
+        case LAYER_TEXT:
+            for (uint8_t column = 0; column < 8; column++) {
+                uint8_t bits = text_column(layer->text, length,
+                                           state + column - 8);
+                for (uint8_t y = 0; y < 7; y++) {
+                    if ((bits >> y) & 1) {
+                        light(layer, 7 - y, 0, column);
+                    }
+                }
+            }
+            break;
+
+        case LAYER_STATUS:
+            if (state) {
+                light(layer, layer->level, layer->row, layer->column);
+            }
+            break;
+    }
+
+    return true;
+}
+
+/**
+ * Parses one line of OVERLAYS_FILE into the given layer.
+ */
+static bool parse_layer(char *line, struct Layer *layer) {
+    char type[8];
+    unsigned int color, level, row, column, blink = 0;
+    int offset = 0;
+
+    memset(layer, 0, sizeof(struct Layer));
+    layer->state = -1;
+    if (sscanf(line, "%7s %6x%n", type, &color, &offset) != 2) {
+        return false;
+    }
+
+    layer->red = MIN(convert_to_4bits(color >> 16), MAX_RED_BRIGHTNESS);
+    layer->green = convert_to_4bits((color >> 8) & 0xff);
+    layer->blue = convert_to_4bits(color & 0xff);
+    line += offset;
+
+    if (strcmp(type, "text") == 0) {
+        layer->type = LAYER_TEXT;
+        if (sscanf(line, "%lf %n", &layer->speed, &offset) != 1) {
+            return false;
+        }
+
+        snprintf(layer->text, sizeof(layer->text), "%s", line + offset);
+        layer->text[strcspn(layer->text, "\r\n")] = '\0';
+        return true;
+    }
+
+    if (strcmp(type, "status") == 0) {
+        layer->type = LAYER_STATUS;
+        if (sscanf(line, "%u %u %u %u", &level, &row, &column, &blink) < 3 ||
+            level > 7 || row > 7 || column > 7)
+        {
+            return false;
+        }
+
+        layer->level = level;
+        layer->row = row;
+        layer->column = column;
+        layer->blink_ms = blink;
+        return true;
+    }
+
+    return false;
+}
+
+static void read_overlays(struct Overlays *overlays) {
+    overlays->count = 0;
+
+    FILE *file = fopen(OVERLAYS_FILE, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char line[MAX_LAYER_TEXT + 64];
+    while (overlays->count < MAX_LAYERS &&
+           fgets(line, sizeof(line), file) != NULL)
+    {
+        struct Layer *layer = &overlays->layers[overlays->count];
+        if (parse_layer(line, layer)) {
+            overlays->count++;
+        } else if (strspn(line, " \t\r\n") != strlen(line)) {
+            fprintf(stderr, "Invalid overlay: %s", line);
+        }
+    }
+
+    fclose(file);
+    printf("Loaded %d overlays\n", overlays->count);
+}
+
+/**
+ * Reader thread: parses OVERLAYS_FILE into the inactive set every time a
+ * reload is requested and hands it to the refresh loop.
+ */
+static void *overlays_reader(void *context) {
+    struct Compositor *compositor = context;
+    struct timespec poll = {.tv_sec = 0, .tv_nsec = 1000000};
+
+    while (true) {
+        if (sem_wait(&reload_requested) != 0) {
+            if (errno != EINTR) {
+                return NULL;
+            }
+            continue;
+        }
+
+        // The loop takes a new set on its next BAM cycle; until then the
+        // other set may still be in use.
+        while (__atomic_load_n(&compositor->pending, __ATOMIC_ACQUIRE)) {
+            nanosleep(&poll, NULL);
+        }
+
+        read_overlays(&compositor->overlays[compositor->active ^ 1]);
+        __atomic_store_n(&compositor->pending, true, __ATOMIC_RELEASE);
+    }
+}
+
+// --- Compositing ----
+
+/**
+ * Copies the base frame and applies every layer with word-wide operations:
+ * each level holds 6 words (2 per color) and the layer's level mask (2
+ * words) clears what the layer covers before its planes are OR'ed in.
+ */
+static void composite(struct Overlays *overlays, struct Frame *base,
+                      struct Frame *output)
+{
+    memcpy(output->cube, base->cube, sizeof(output->cube));
+    for (uint8_t i = 0; i < overlays->count; i++) {
+        struct Layer *layer = &overlays->layers[i];
+        for (uint8_t level = 0; level < 8; level++) {
+            const uint32_t *mask = layer->mask[level].words;
+            if ((mask[0] | mask[1]) == 0) {
+                continue;
+            }
+
+            for (uint8_t bit = 0; bit < BAM_BITS; bit++) {
+                PlaneWord *words = (PlaneWord *)output->cube[bit][level];
+                const PlaneWord *overlay =
+                    (const PlaneWord *)layer->content.cube[bit][level];
+                for (uint8_t word = 0; word < 6; word++) {
+                    words[word] = (words[word] & ~mask[word % 2]) |
+                                  overlay[word];
+                }
+            }
+        }
+    }
+
+    compute_slot_flags(output);
+}
+
+/**
+ * Filter: returns the base frame when there are no layers, otherwise a
+ * composition (only redone when the base or a layer changed).
+ */
+static struct Frame *apply_layers(void *context, struct Frame *base,
+                                  uint64_t now)
+{
+    struct Compositor *compositor = context;
+    if (__atomic_load_n(&compositor->pending, __ATOMIC_ACQUIRE)) {
+        compositor->active ^= 1;
+        compositor->dirty = true;
+        __atomic_store_n(&compositor->pending, false, __ATOMIC_RELEASE);
+    }
+
+    struct Overlays *overlays = &compositor->overlays[compositor->active];
+    if (overlays->count == 0) {
+        return base;
+    }
+
+    for (uint8_t i = 0; i < overlays->count; i++) {
+        if (render_layer(&overlays->layers[i], now - compositor->started)) {
+            compositor->dirty = true;
+        }
+    }
+
+    struct Frame *output = &compositor->output[compositor->output_index];
+    if (!compositor->dirty && base == compositor->base) {
+        return output;
+    }
+
+    compositor->output_index ^= 1;
+    output = &compositor->output[compositor->output_index];
+
+    uint64_t start = monotonic_ns();
+    composite(overlays, base, output);
+    uint64_t elapsed = monotonic_ns() - start;
+
+    compositor->composites++;
+    compositor->total_ns += elapsed;
+    if (elapsed > compositor->max_ns) {
+        compositor->max_ns = elapsed;
+    }
+
+    compositor->base = base;
+    compositor->dirty = false;
+    return output;
+}
+
+// --- Exposed functions ----
+
+/**
+ * Reads the layers from OVERLAYS_FILE (no layers if the file doesn't exist),
+ * starts the thread that reads it again on `reload_overlays` and configures
+ * the filter that composites them.
+ *
+ * - parameter compositor: The compositor to configure.
+ * - parameter filter:     A pointer that will be configured as the refresh
+ *                         loop's filter.
+ */
+void setup_compositor(struct Compositor *compositor, struct Filter *filter) {
+    memset(compositor, 0, sizeof(struct Compositor));
+    compositor->started = monotonic_ns();
+    compositor->dirty = true;
+    read_overlays(&compositor->overlays[0]);
+
+    // The refresh loop runs with SCHED_FIFO; the reader must not inherit it.
+    pthread_attr_t attributes;
+    struct sched_param parameters = {.sched_priority = 0};
+    pthread_attr_init(&attributes);
+    pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attributes, SCHED_OTHER);
+    pthread_attr_setschedparam(&attributes, &parameters);
+
+    sem_init(&reload_requested, 0, 0);
+    int error = pthread_create(&compositor->reader, &attributes,
+                               overlays_reader, compositor);
+    pthread_attr_destroy(&attributes);
+    if (error != 0) {
+        fprintf(stderr, "Can't start overlays thread (%s); overlays won't "
+                "be reloaded\n", strerror(error));
+    }
+
+    filter->apply = apply_layers;
+    filter->context = compositor;
+}
+
+/**
+ * Asks the compositor's reader thread to read OVERLAYS_FILE again; the new
+ * layers are shown from the first BAM cycle after they're parsed. Safe to
+ * call from a signal handler.
+ */
+void reload_overlays(void) {
+    sem_post(&reload_requested);
+}
+
+/**
+ * Prints how many compositions were made and their cost, then resets the
+ * counters.
+ *
+ * - parameter compositor: The compositor.
+ */
+void print_compositor_stats(struct Compositor *compositor) {
+    if (compositor->composites == 0) {
+        return;
+    }
+
+    printf("Layers: %llu compositions, avg %.1f us, max %.1f us\n",
+           (unsigned long long)compositor->composites,
+           compositor->total_ns / 1e3 / compositor->composites,
+           compositor->max_ns / 1e3);
+
+    compositor->composites = 0;
+    compositor->total_ns = 0;
+    compositor->max_ns = 0;
+}
@@ -0,0 +1,117 @@
+#ifndef _LAYERSH_
+#define _LAYERSH_
+
+#include "animation.h"
+
+#include <pthread.h>
+
+#define MAX_LAYERS          4
+#define MAX_LAYER_TEXT      128
+
+/**
+ * File describing the overlays shown on top of whatever is playing, one
+ * layer per line (later lines are drawn on top):
+ *
+ * text RRGGBB <columns per second> <message>
+ *     Scrolls the message (5x7 font) along the front face of the cube.
+ *
+ * status RRGGBB <level> <row> <column> [<blink period in ms>]
+ *     Lights a single LED, optionally blinking.
+ *
+ * The file is read at startup and every time lyftcube gets SIGUSR1; the
+ * reloads happen on a separate thread so the refresh loop never touches it.
+ */
+#define OVERLAYS_FILE   "/opt/lyft/lyftcube/cube/animations/current_overlays"
+
+enum LayerType {
+    LAYER_TEXT,
+    LAYER_STATUS,
+};
+
+/// Bit planes are 8 rows (bytes) per color and level; the mask of a level
+/// covers the same 8 rows so it can be applied a word at a time.
+union LevelMask {
+    uint8_t rows[8];
+    uint32_t words[2];
+};
+
+/**
+ * An overlay source. `content` holds its rendered bit planes and `mask` the
+ * LEDs it covers on each level; `state` is what was last rendered (scroll
+ * position, blink phase) so layers are only rendered when they change.
+ */
+struct Layer {
+    enum LayerType type;
+    uint8_t red, green, blue;
+
+    char text[MAX_LAYER_TEXT];
+    double speed;
+
+    uint8_t level, row, column;
+    uint32_t blink_ms;
+
+    struct Frame content;
+    union LevelMask mask[8];
+    int64_t state;
+};
+
+/// The layers parsed from OVERLAYS_FILE.
+struct Overlays {
+    struct Layer layers[MAX_LAYERS];
+    uint8_t count;
+};
+
+/**
+ * Composites the layers on top of every frame picked by the refresh loop (as
+ * its `struct Filter`). Output frames alternate between two buffers so a new
+ * composition never changes the frame being displayed.
+ *
+ * The refresh loop uses `overlays[active]`. The reader thread parses reloads
+ * into the other set and sets `pending`; the loop then swaps the sets and
+ * clears it, which hands the old set back to the reader.
+ */
+struct Compositor {
+    struct Overlays overlays[2];
+    uint8_t active;
+    bool pending;
+    pthread_t reader;
+    uint64_t started;
+
+    struct Frame output[2];
+    uint8_t output_index;
+    struct Frame *base;
+    bool dirty;
+
+    // Cost of the compositions since the last `print_compositor_stats`.
+    uint64_t composites;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/**
+ * Reads the layers from OVERLAYS_FILE (no layers if the file doesn't exist),
+ * starts the thread that reads it again on `reload_overlays` and configures
+ * the filter that composites them.
+ *
+ * - parameter compositor: The compositor to configure.
+ * - parameter filter:     A pointer that will be configured as the refresh
+ *                         loop's filter.
+ */
+void setup_compositor(struct Compositor *compositor, struct Filter *filter);
+
+/**
+ * Asks the compositor's reader thread to read OVERLAYS_FILE again; the new
+ * layers are shown from the first BAM cycle after they're parsed. Safe to
+ * call from a signal handler.
+ */
+void reload_overlays(void);
+
+/**
+ * Prints how many compositions were made and their cost, then resets the
+ * counters.
+ *
+ * - parameter compositor: The compositor.
+ */
+void print_compositor_stats(struct Compositor *compositor);
+
+#endif
@@ -1,52 +1,273 @@
 #include "animation.h"
+#include "audio.h"
+#include "framebuffer.h"
 #include "GPIO.h"
+#include "interpolation.h"
+#include "layers.h"
+#include "parser.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <sched.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 struct Animation animation;
+struct AnimationSwap swap;
+struct Compositor compositor;
+struct Interpolator interpolator;
+
+/// Posted on SIGHUP (sem_post is async-signal-safe).
+static sem_t reload_requested;
+
+// --- Pretend driver (debug only) ----
+
+static uint8_t pretend_buffer[24];
+
+static void pretend_latch(void *context, uint8_t *buffer) {
+    memcpy(pretend_buffer, buffer, sizeof(pretend_buffer));
+}
+
+static void pretend_show(void *context, uint8_t level, uint8_t bit, bool on)
+{
+    printf("=========== bit: %d, level: %d, %s ============\n", bit, level,
+           on ? "on" : "off");
+    if (on) {
+        dump_buffer(pretend_buffer);
+    }
+
+    sleep(1);
+}
+
+static void pretend_wait(void *context, uint64_t deadline) {
+    // Every level is shown for a second instead (see pretend_show).
+}
+
+static uint64_t pretend_clock(void *context) {
+    return monotonic_ns();
+}
+
+static struct Driver pretend_driver = {
+    .latch = pretend_latch,
+    .show = pretend_show,
+    .wait = pretend_wait,
+    .clock = pretend_clock,
+};
+
+// --- Signal handlers ----
 
 void terminate(int signal) {
     printf("Terminating LED cube ...\n");
+    print_refresh_stats(&animation);
+    print_compositor_stats(&compositor);
+    print_interpolation_stats(&interpolator);
     restore_gpios();
     exit(EXIT_SUCCESS);
 }
 
 void restart(int signal) {
+    sem_post(&reload_requested);
+}
+
+void overlays(int signal) {
+    reload_overlays();
+}
+
+// --- Animation loader ----
+
+/**
+ * Loads the animation in ANIMATION_FILE every time lyftcube gets SIGHUP,
+ * hands it to the refresh loop (see `struct AnimationSwap`) and frees the
+ * one it replaced once the loop has moved to the new one. An animation that
+ * can't be loaded leaves the current one playing.
+ */
+static void *animation_loader(void *context) {
+    struct timespec poll = {.tv_sec = 0, .tv_nsec = 1000000};
     char path[PATH_MAX + 1];
-    if (animation.frames != NULL) {
-        free(animation.frames);
+
+    while (true) {
+        if (sem_wait(&reload_requested) != 0) {
+            if (errno != EINTR) {
+                return NULL;
+            }
+            continue;
+        }
+
+        struct Animation next;
+        if (!load_current_animation(&next, path)) {
+            fprintf(stderr, "Can't load the new animation; keeping the "
+                            "current one\n");
+            continue;
+        }
+
+        swap.next = next;
+        __atomic_store_n(&swap.pending, true, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&swap.pending, __ATOMIC_ACQUIRE)) {
+            nanosleep(&poll, NULL);
+        }
+
+        print_refresh_stats(&swap.next);
+        print_compositor_stats(&compositor);
+        print_interpolation_stats(&interpolator);
+        free(swap.next.frames);
+        printf("Loaded animation %s...\n", path);
     }
+}
+
+/**
+ * Starts the thread that loads the animations requested with SIGHUP.
+ */
+static bool start_animation_loader(void) {
+    // The refresh loop runs with SCHED_FIFO; the loader must not inherit it
+    // or parsing a GIF would stall the multiplexing.
+    pthread_attr_t attributes;
+    struct sched_param parameters = {.sched_priority = 0};
+    pthread_attr_init(&attributes);
+    pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attributes, SCHED_OTHER);
+    pthread_attr_setschedparam(&attributes, &parameters);
 
-    if (!load_current_animation(&animation, path)) {
-        restore_gpios();
-        exit(EXIT_FAILURE);
+    pthread_t thread;
+    sem_init(&reload_requested, 0, 0);
+    int error = pthread_create(&thread, &attributes, animation_loader, NULL);
+    pthread_attr_destroy(&attributes);
+    if (error != 0) {
+        fprintf(stderr, "Can't start animation loader (%s)\n",
+                strerror(error));
+        return false;
     }
 
-    printf("Loaded animation %s...\n", path);
+    return true;
+}
+
+// --- Main ----
+
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-p] [-f] [-d] [-s speed] [-b mode] [-m | -a "
+                    "source [-v visualizer]]\n", name);
+    fprintf(stderr, "  -p        Pretend; print every level instead of "
+                    "driving the GPIOs\n");
+    fprintf(stderr, "  -f        Fade every frame into the next one\n");
+    fprintf(stderr, "  -d        Temporal dithering of the 8 bits colors "
+                    "(not with -f)\n");
+    fprintf(stderr, "  -s speed  Playback speed multiplier (default 1.0)\n");
+    fprintf(stderr, "  -b mode   BAM schedule: binary (default) or "
+                    "interleaved\n");
+    fprintf(stderr, "  -m        Show the frames local producers draw into "
+                    "the shared framebuffer (/dev/shm" FRAMEBUFFER_NAME ", "
+                    "lyftcube's group only)\n");
+    fprintf(stderr, "  -a source Audio-reactive live mode from a WAV file or "
+                    "raw s16le PCM pipe (- for stdin)\n");
+    fprintf(stderr, "  -v name   Audio visualizer: spectrum (default) or "
+                    "pulse\n");
 }
 
 int main(int argc, char *argv[]) {
-    bool pretend = argc > 1 && (strcmp(argv[1], "-p") == 0);
+    struct Options options = {.speed = 1.0, .bam_mode = BAM_BINARY};
+    struct Driver *driver = &gpio_driver;
+    struct Source audio_source, framebuffer_source;
+    struct Filter layers;
+    char *audio_path = NULL, *visualizer = "spectrum";
+    bool shared_framebuffer = false, dithering = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "pfds:b:ma:v:")) != -1) {
+        switch (option) {
+            case 'p':
+                driver = &pretend_driver;
+                break;
+
+            case 'f':
+                options.interpolator = &interpolator;
+                break;
+
+            case 'd':
+                dithering = true;
+                break;
+
+            case 's':
+                if (!parse_speed(optarg, &options.speed)) {
+                    fprintf(stderr, "Invalid speed %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'b':
+                if (!parse_bam_mode(optarg, &options.bam_mode)) {
+                    fprintf(stderr, "Invalid BAM mode %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'm':
+                shared_framebuffer = true;
+                break;
+
+            case 'a':
+                audio_path = optarg;
+                break;
+
+            case 'v':
+                visualizer = optarg;
+                break;
+
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // Blends are made between whole keyframes; the dithering phases would
+    // need a blend each.
+    if (dithering && options.interpolator != NULL) {
+        fprintf(stderr, "Fading (-f) can't be combined with dithering (-d)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (shared_framebuffer && audio_path != NULL) {
+        fprintf(stderr, "The shared framebuffer (-m) and the audio mode (-a) "
+                        "can't be used together\n");
+        return EXIT_FAILURE;
+    }
+
     printf("Lyft LED cube starting ...\n");
 
     // Make sure we clean up the state after a CTRL+C
     signal(SIGINT, terminate);
     signal(SIGTERM, terminate);
 
-    // Reload animation on SIGHUB
-    signal(SIGHUP, restart);
+    set_bam_mode(options.bam_mode);
+    set_dithering(dithering);
 
-    restart(0);
-    if (animation.frames == NULL || animation.frames_count == 0) {
+    char path[PATH_MAX + 1];
+    if (!load_current_animation(&animation, path) ||
+        animation.frames_count == 0)
+    {
         fprintf(stderr, "Couldn't read animation file.\n");
         return EXIT_FAILURE;
     }
 
+    printf("Loaded animation %s...\n", path);
+
+    setup_compositor(&compositor, &layers);
+    options.filter = &layers;
+
+    if (!start_animation_loader()) {
+        return EXIT_FAILURE;
+    }
+
+    // Reload animation on SIGHUP
+    signal(SIGHUP, restart);
+    options.swap = &swap;
+
+    // Reload overlays on SIGUSR1
+    signal(SIGUSR1, overlays);
+
     // We need root to access GPIOS and scheduler.
     uid_t uid = getuid();
     if (setuid(0) == -1) {
@@ -64,7 +285,23 @@ int main(int argc, char *argv[]) {
     }
 
     setuid(uid);
-    multiplex(&animation, pretend);
+    if (audio_path != NULL) {
+        if (!start_audio(audio_path, visualizer, &audio_source)) {
+            restore_gpios();
+            return EXIT_FAILURE;
+        }
+
+        options.source = &audio_source;
+    } else if (shared_framebuffer) {
+        if (!start_framebuffer(&framebuffer_source)) {
+            restore_gpios();
+            return EXIT_FAILURE;
+        }
+
+        options.source = &framebuffer_source;
+    }
+
+    multiplex(&animation, driver, &options);
     free(animation.frames);
     return EXIT_SUCCESS;
 }
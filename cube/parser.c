@@ -1,15 +1,22 @@
+#include "frames.h"
 #include "parser.h"
+#include "voxels.h"
 
 #include <gif_lib.h>
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
 #define HEIGHT      64
 #define WIDTH       8
 
+/// Red is capped at MAX_RED_BRIGHTNESS before dithering too.
+#define MAX_RED_COMPONENT   (MAX_RED_BRIGHTNESS * 255 / 15)
+
+static uint8_t phases = 1;
+
 // --- Misc helpers ----
 
 char *binary(int n) {
@@ -21,11 +28,13 @@ char *binary(int n) {
     return binary;
 }
 
-uint8_t convert_to_4bits(int component) {
-    double percent = (double)component / 255.0;
-    return MIN(ceil(0b1111 * percent), 0b1111);
-}
-
+/**
+ * Returns the delay (in centiseconds) of a GIF frame, or the previous
+ * frame's delay when it doesn't have one.
+ *
+ * - parameter image:          The GIF frame.
+ * - parameter previous_delay: The delay of the previous frame.
+ */
 uint16_t find_delay_time(SavedImage *image, int previous_delay) {
     ExtensionBlock *blocks = image->ExtensionBlocks;
 
@@ -38,11 +47,23 @@ uint16_t find_delay_time(SavedImage *image, int previous_delay) {
         }
     }
 
-    return -1;
+    return previous_delay;
 }
 
 // --- Exposed functions ----
 
+/**
+ * Enables temporal dithering for the animations parsed from now on: every
+ * frame is stored as DITHER_PHASES phases that the refresh loop shows on
+ * consecutive BAM cycles, adding the brightness lost by the 4 bits
+ * conversion back on average.
+ *
+ * - parameter enabled: Whether the next animations should be dithered.
+ */
+void set_dithering(bool enabled) {
+    phases = enabled ? DITHER_PHASES : 1;
+}
+
 /**
  * Prints an array of 24 bytes containing a level of the LED cube for every
  * color (8 x 3). Use for debug only.
@@ -63,12 +84,23 @@ void dump_buffer(unsigned char *buffer) {
 }
 
 /**
- * Parse animation frames from a multi-frame animated GIF file.
+ * Parse animation frames from a multi-frame animated GIF file, or load them
+ * from its converted frames when they exist (see frames.h) and dithering is
+ * off or the GIF isn't written yet.
  *
  * - parameter gif_path:      A path to a multiframe GIF file containing all cube
  *                            levels one on top of each other.
  */
 bool parse_gif(char *gif_path, struct Animation *animation) {
+    // Dithering needs the 8 bits colors, which only the GIF has (raw
+    // uploads are played without it until their GIF is written).
+    if ((phases == 1 || access(gif_path, F_OK) != 0) &&
+        load_frames(gif_path, animation))
+    {
+        printf("Loaded %u converted frames\n", animation->frames_count);
+        return true;
+    }
+
     int error = 0;
     GifFileType *gif = DGifOpenFileName(gif_path, &error);
     if (gif == NULL || DGifSlurp(gif) != GIF_OK) {
@@ -82,7 +114,8 @@ bool parse_gif(char *gif_path, struct Animation *animation) {
 
     uint16_t frame_count = gif->ImageCount;
     animation->frames_count = frame_count;
-    animation->frames = calloc(frame_count, sizeof(struct Frame));
+    animation->phases = phases;
+    animation->frames = calloc(frame_count * phases, sizeof(struct Frame));
 
     SavedImage *frames = gif->SavedImages;
     uint16_t delay = 3;
@@ -100,9 +133,12 @@ bool parse_gif(char *gif_path, struct Animation *animation) {
         uint8_t top = frame_desc.Top, left = frame_desc.Left;
         uint8_t height = frame_desc.Height, width = frame_desc.Width;
 
-        // Setup animation frame
-        struct Frame *frame = &animation->frames[frame_index];
-        frame->duration = find_delay_time(&imageframe, delay);
+        // Setup animation frame (and its dithering phases)
+        struct Frame *frame = &animation->frames[frame_index * phases];
+        delay = find_delay_time(&imageframe, delay);
+        for (uint8_t phase = 0; phase < phases; phase++) {
+            frame[phase].duration = delay > 1 ? delay * 10 : DEFAULT_DELAY_MS;
+        }
 
         for (uint16_t y = top, i = 0; y < top + height; y++) {
             for (uint8_t x = left; x < left + width; x++) {
@@ -115,18 +151,16 @@ bool parse_gif(char *gif_path, struct Animation *animation) {
         GifColorType *colors = colorMap->Colors;
         for (uint8_t abs_y = 0; abs_y < HEIGHT; abs_y++) {
             for (uint8_t x = 0; x < WIDTH; x++) {
-                GifByteType color_index = bytes[x + (abs_y * WIDTH)];
-                uint8_t r = MIN(convert_to_4bits(colors[color_index].Red), 11);
-                uint8_t g = convert_to_4bits(colors[color_index].Green);
-                uint8_t b = convert_to_4bits(colors[color_index].Blue);
-
-                uint8_t level = abs_y / 8;
-                uint8_t y = abs_y % 8;
-                for (uint8_t bit = 0; bit < 4; bit++) {
-                    frame->cube[bit][level][y] |= ((r >> bit) & 1) << x;
-                    frame->cube[bit][level][y + 8] |= ((g >> bit) & 1) << x;
-                    frame->cube[bit][level][y + 16] |= ((b >> bit) & 1) << x;
+                GifColorType color = colors[bytes[x + (abs_y * WIDTH)]];
+                if (phases > 1) {
+                    set_dithered_led(frame, phases, abs_y / 8, abs_y % 8, x,
+                                     MIN(color.Red, MAX_RED_COMPONENT),
+                                     color.Green, color.Blue);
+                    continue;
                 }
+
+                set_color_led(frame, abs_y / 8, abs_y % 8, x, color.Red,
+                              color.Green, color.Blue);
             }
         }
     }
@@ -2,15 +2,39 @@
 #define _PARSERH_
 
 #include "animation.h"
+#include "voxels.h"
+
+#include <gif_lib.h>
+
+/**
+ * Enables temporal dithering for the animations parsed from now on: every
+ * frame is stored as DITHER_PHASES phases that the refresh loop shows on
+ * consecutive BAM cycles, adding the brightness lost by the 4 bits
+ * conversion back on average.
+ *
+ * - parameter enabled: Whether the next animations should be dithered.
+ */
+void set_dithering(bool enabled);
 
 /**
- * Parse animation frames from a multi-frame animated GIF file.
+ * Parse animation frames from a multi-frame animated GIF file, or load them
+ * from its converted frames when they exist (see frames.h) and dithering is
+ * off or the GIF isn't written yet.
  *
  * - parameter gif_path:      A path to a multiframe GIF file containing all cube
  *                            levels one on top of each other.
  */
 bool parse_gif(char *gif_path, struct Animation *animation);
 
+/**
+ * Returns the delay (in centiseconds) of a GIF frame, or the previous
+ * frame's delay when it doesn't have one.
+ *
+ * - parameter image:          The GIF frame.
+ * - parameter previous_delay: The delay of the previous frame.
+ */
+uint16_t find_delay_time(SavedImage *image, int previous_delay);
+
 /**
  * Prints an array of 24 bytes containing a level of the LED cube for every
  * color (8 x 3). Use for debug only.
@@ -0,0 +1,56 @@
+#include "queue.h"
+
+#include <stddef.h>
+
+/**
+ * Returns the slot the producer should render the next frame into, or NULL
+ * when the queue is full (the consumer is falling behind). Producer only.
+ *
+ * - parameter queue: The queue.
+ */
+struct QueuedFrame *queue_reserve(struct FrameQueue *queue) {
+    uint32_t head = queue->head;
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+    // One slot is always kept for the frame the consumer is displaying.
+    if (head - tail >= FRAME_QUEUE_SIZE - 1) {
+        queue->dropped++;
+        return NULL;
+    }
+
+    return &queue->slots[head % FRAME_QUEUE_SIZE];
+}
+
+/**
+ * Makes the slot returned by `queue_reserve` visible to the consumer.
+ * Producer only.
+ *
+ * - parameter queue: The queue.
+ */
+void queue_publish(struct FrameQueue *queue) {
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the newest published frame, releasing every older one back to the
+ * producer, or NULL if nothing was ever published. The returned slot stays
+ * valid until the next call. Consumer only.
+ *
+ * - parameter queue: The queue.
+ * - parameter fresh: A pointer that will be set to true when the returned
+ *                    frame wasn't returned by a previous call.
+ */
+struct QueuedFrame *queue_latest(struct FrameQueue *queue, bool *fresh) {
+    uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = queue->tail;
+
+    *fresh = head != tail;
+    if (*fresh) {
+        // Take the newest frame; every older one (including the one that was
+        // being displayed) goes back to the producer.
+        tail = head;
+        __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return tail == 0 ? NULL : &queue->slots[(tail - 1) % FRAME_QUEUE_SIZE];
+}
@@ -0,0 +1,60 @@
+#ifndef _QUEUEH_
+#define _QUEUEH_
+
+#include "animation.h"
+
+/// Number of slots in a frame queue (must be a power of two). The consumer
+/// always holds the slot being displayed, so the producer can be up to
+/// FRAME_QUEUE_SIZE - 1 frames ahead.
+#define FRAME_QUEUE_SIZE    4
+
+struct QueuedFrame {
+    struct Frame frame;
+    uint64_t timestamp;
+};
+
+/**
+ * Lock-free single-producer/single-consumer queue of frames. The producer
+ * renders straight into a reserved slot and publishes it; the consumer (the
+ * refresh loop) displays straight from the slot until a newer one shows up,
+ * so frames are never copied.
+ *
+ * `head` (frames published) and `tail` (frames taken) are free-running
+ * counters only written by the producer and the consumer respectively. The
+ * frame being displayed is the one at `tail - 1`.
+ */
+struct FrameQueue {
+    struct QueuedFrame slots[FRAME_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+};
+
+/**
+ * Returns the slot the producer should render the next frame into, or NULL
+ * when the queue is full (the consumer is falling behind). Producer only.
+ *
+ * - parameter queue: The queue.
+ */
+struct QueuedFrame *queue_reserve(struct FrameQueue *queue);
+
+/**
+ * Makes the slot returned by `queue_reserve` visible to the consumer.
+ * Producer only.
+ *
+ * - parameter queue: The queue.
+ */
+void queue_publish(struct FrameQueue *queue);
+
+/**
+ * Returns the newest published frame, releasing every older one back to the
+ * producer, or NULL if nothing was ever published. The returned slot stays
+ * valid until the next call. Consumer only.
+ *
+ * - parameter queue: The queue.
+ * - parameter fresh: A pointer that will be set to true when the returned
+ *                    frame wasn't returned by a previous call.
+ */
+struct QueuedFrame *queue_latest(struct FrameQueue *queue, bool *fresh);
+
+#endif
@@ -8,9 +8,13 @@
 #include <string.h>
 
 #include "endpoints.h"
+#include "metadata.h"
+#include "raw.h"
+#include "../frames.h"
 
-#define ANIMATIONS_PATH             "/opt/lyft/lyftcube/cube/animations/"
 #define CURRENT_ANIMATION_FILE      ANIMATIONS_PATH "current_animation"
+#define CURRENT_OVERLAYS_FILE       ANIMATIONS_PATH "current_overlays"
+#define MAX_OVERLAYS_LENGTH         1024
 #define MAX_UPLOAD_LENGTH           1024 * 1024 * 10
 #define MAX_RESPONSE                2048
 #define MAX_FILES_LIST              100
@@ -44,11 +48,31 @@ bool return_ok(char **body, size_t *size) {
     return true;
 }
 
-// ----------- HTTP route functions -----------
+bool return_file(char *path, char **body, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
 
-bool list_animations(ad_http_t *http, char *id, char **body, size_t *size) {
-    printf("Listing animations on %s\n", ANIMATIONS_PATH);
+    fseek(file, 0L, SEEK_END);
+    size_t file_size = ftell(file);
+    rewind(file);
 
+    printf("Returning file %s (size: %zu)\n", path, file_size);
+
+    *body = malloc(sizeof(char) * file_size);
+    *size = file_size;
+
+    fread(*body, 1, file_size, file);
+    fclose(file);
+    return true;
+}
+
+/**
+ * Lists every animation as a line: name,id,size and, when `with_metadata` is
+ * true, followed by the animation's cached metadata.
+ */
+bool list(char **body, size_t *size, bool with_metadata) {
     DIR *directory = opendir(ANIMATIONS_PATH);
     if (directory == NULL) {
         return false;
@@ -67,9 +91,17 @@ bool list_animations(ad_http_t *http, char *id, char **body, size_t *size) {
             char animation[name_len - 3];
             snprintf(animation, name_len - 3, "%s", entity->d_name);
 
-            int total = sprintf(*body + *size, "%s,%s,%jd\n",
+            int total = sprintf(*body + *size, "%s,%s,%jd",
                 animation, animation, animation_size(animation));
             *size += total;
+
+            char line[MAX_RESPONSE];
+            char *path = with_metadata ? animation_path(animation) : NULL;
+            if (path != NULL && read_metadata(path, line, sizeof(line))) {
+                *size += sprintf(*body + *size, ",%s", line);
+            }
+
+            *size += sprintf(*body + *size, "\n");
         }
     }
 
@@ -77,31 +109,53 @@ bool list_animations(ad_http_t *http, char *id, char **body, size_t *size) {
     return true;
 }
 
+// ----------- HTTP route functions -----------
+
+bool list_animations(ad_http_t *http, char *id, char **body, size_t *size) {
+    printf("Listing animations on %s\n", ANIMATIONS_PATH);
+    return list(body, size, false);
+}
+
 bool animation(ad_http_t *http, char *id, char **body, size_t *size) {
     if (id == NULL) {
         return list_animations(http, id, body, size);
     }
 
     char *path = animation_path(id);
-    FILE *file = fopen(path, "rb");
-    if (file == NULL) {
+    if (path == NULL) {
         return false;
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+    return return_file(path, body, size);
+}
 
-    printf("Returning animation %s (size: %d)\n", path, file_size);
+bool metadata(ad_http_t *http, char *id, char **body, size_t *size) {
+    if (id == NULL) {
+        printf("Listing animations metadata on %s\n", ANIMATIONS_PATH);
+        return list(body, size, true);
+    }
 
-    *body = malloc(sizeof(char) * file_size);
-    *size = file_size;
+    char *path = animation_path(id);
+    char line[MAX_RESPONSE];
+    if (path == NULL || !read_metadata(path, line, sizeof(line))) {
+        return false;
+    }
 
-    fread(*body, 1, file_size, file);
-    fclose(file);
+    *body = calloc(sizeof(char), MAX_RESPONSE * 2);
+    *size = snprintf(*body, MAX_RESPONSE * 2, "%s,%s,%jd,%s\n", id, id,
+                     animation_size(id), line);
     return true;
 }
 
+bool preview(ad_http_t *http, char *id, char **body, size_t *size) {
+    char *path = id == NULL ? NULL : animation_path(id);
+    if (path == NULL || (path = preview_path(path)) == NULL) {
+        return false;
+    }
+
+    return return_file(path, body, size);
+}
+
 bool play_animation(ad_http_t *http, char *id, char **body, size_t *size) {
     char *path = animation_path(id);
     if (path == NULL) {
@@ -128,27 +182,110 @@ bool play_animation(ad_http_t *http, char *id, char **body, size_t *size) {
     return true;
 }
 
-bool upload(ad_http_t *http, char *name, char **body, size_t *size) {
+bool receive_upload(ad_http_t *http, char *name, void **state) {
+    struct evbuffer *input = http->request.inbuf;
+    off_t length = http->request.contentlength;
+    if (length > MAX_UPLOAD_LENGTH || http->request.bodyin > MAX_UPLOAD_LENGTH)
+    {
+        printf("Refusing upload %s (too big)\n", name);
+        return false;
+    }
+
+    // Raw animations are drained from the body as they arrive, GIFs are
+    // kept in it until it's complete.
+    if (*state == NULL && !is_raw_animation(input)) {
+        char signature[4];
+        return evbuffer_copyout(input, signature, sizeof(signature)) <
+               sizeof(signature) || memcmp(signature, "GIF8", 4) == 0;
+    }
+
+    return receive_raw_animation((struct RawUpload **)state, input,
+                                 length > 0 ? length : 0);
+}
+
+bool upload(ad_http_t *http, char *name, void *state, char **body,
+            size_t *size)
+{
     if (http->request.bodyin > MAX_UPLOAD_LENGTH) {
         return false;
     }
 
     char *path = animation_path(name);
-    FILE *file = fopen(path, "wb");
-    if (file == NULL) {
+    if (path == NULL) {
         return false;
     }
 
     printf("Upload animation %s (sized %zu)...\n", path, http->request.bodyin);
 
+    // Raw animations are played from their frames, so their GIF and
+    // metadata are made once they are playing.
+    struct RawUpload *raw_upload = state;
+    if (raw_upload != NULL) {
+        if (!convert_raw_animation(raw_upload, path)) {
+            return false;
+        }
+
+        bool playing = play_animation(http, name, body, size);
+        if (write_raw_gif(raw_upload, path)) {
+            refresh_metadata(path);
+        }
+        return playing;
+    }
+
+    // A raw animation shorter than its header.
+    if (is_raw_animation(http->request.inbuf)) {
+        return false;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
     char data[http->request.bodyin];
     evbuffer_copyout(http->request.inbuf, data, http->request.bodyin);
     fwrite(data, 1, http->request.bodyin, file);
     fclose(file);
 
+    // Frames converted from a previous raw upload are stale now.
+    char buffer[PATH_MAX];
+    char *frames = frames_path(path, buffer);
+    if (frames != NULL) {
+        remove(frames);
+    }
+
+    // Clients list animations with their metadata and previews, extract
+    // them once now instead of on every list.
+    refresh_metadata(path);
+
     return play_animation(http, name, body, size);
 }
 
+void free_upload(ad_conn_t *conn, void *state) {
+    free_raw_upload(state);
+}
+
+bool overlays(ad_http_t *http, char *id, char **body, size_t *size) {
+    if (http->request.bodyin > MAX_OVERLAYS_LENGTH) {
+        return false;
+    }
+
+    FILE *file = fopen(CURRENT_OVERLAYS_FILE, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    printf("Setting overlays (sized %zu)...\n", http->request.bodyin);
+
+    char data[http->request.bodyin + 1];
+    evbuffer_copyout(http->request.inbuf, data, http->request.bodyin);
+    fwrite(data, 1, http->request.bodyin, file);
+    fclose(file);
+
+    system("killall -USR1 lyftcube");
+    return return_ok(body, size);
+}
+
 bool start(ad_http_t *http, char *id, char **body, size_t *size) {
     system("sudo /etc/init.d/lyftcube start");
     printf("Starting lyftcube ...\n");
@@ -165,6 +302,18 @@ bool stop(ad_http_t *http, char *id, char **body, size_t *size) {
 
 bool delete(ad_http_t *http, char *id, char **body, size_t *size) {
     char *path = animation_path(id);
+    if (path == NULL) {
+        return false;
+    }
+
     printf("Removing animation at %s ...\n", path);
+    remove_metadata(path);
+
+    char buffer[PATH_MAX];
+    char *frames = frames_path(path, buffer);
+    if (frames != NULL) {
+        remove(frames);
+    }
+
     return remove(path) != -1;
 }
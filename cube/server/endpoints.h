@@ -1,5 +1,7 @@
 #include <asyncd/asyncd.h>
 
+#define ANIMATIONS_PATH             "/opt/lyft/lyftcube/cube/animations/"
+
 /**
  * These functions contain the logic to server each specific endpoint, every
  * one of these functions take the parameters described as follows:
@@ -27,17 +29,60 @@ bool list_animations(ad_http_t *http, char *id, char **body, size_t *size);
  */
 bool animation(ad_http_t *http, char *id, char **body, size_t *size);
 
+/**
+ * Returns the metadata of the animation with the given `id` as a comma
+ * separated line: name,id,size,frames,duration_ms,brightness,palette (see
+ * metadata.h). When `id` is NULL every animation is listed that way.
+ */
+bool metadata(ad_http_t *http, char *id, char **body, size_t *size);
+
+/**
+ * Returns a small GIF previewing the animation with the given id (up to
+ * PREVIEW_FRAMES frames sampled from it).
+ */
+bool preview(ad_http_t *http, char *id, char **body, size_t *size);
+
 /**
  * Plays the animation with the given id.
  */
 bool play_animation(ad_http_t *http, char *id, char **body, size_t *size);
 
+/**
+ * Receives the body of an upload as it arrives and refuses it as soon as
+ * it's too big or invalid: raw animations are validated (and inflated)
+ * while they stream in, GIFs are checked for their signature.
+ *
+ * - parameter state: The upload's state, kept between calls (it's NULL on
+ *                    the first one, see `free_upload`).
+ */
+bool receive_upload(ad_http_t *http, char *name, void **state);
+
 /**
  * Create (or edit) an animation with the content of the request body (it
- * should be a GIF file). The animation id will match the name and the file
- * will be stored into the animations directory.
+ * should be a GIF file or a raw voxel animation, see raw.h) once it has
+ * been received by `receive_upload`. The animation id will match the name
+ * and the file will be stored into the animations directory. Raw
+ * animations are played as soon as their frames are converted; their GIF
+ * is written afterwards.
+ *
+ * - parameter state: The upload's state (see `receive_upload`).
+ */
+bool upload(ad_http_t *http, char *name, void *state, char **body,
+            size_t *size);
+
+/**
+ * Frees the state of an upload (see `receive_upload`).
+ */
+void free_upload(ad_conn_t *conn, void *state);
+
+/**
+ * Replaces the overlays drawn on top of the playing animation with the
+ * request body, one layer per line (an empty body removes them):
+ *
+ * text RRGGBB <columns per second> <message>
+ * status RRGGBB <level> <row> <column> [<blink period in ms>]
  */
-bool upload(ad_http_t *http, char *name, char **body, size_t *size);
+bool overlays(ad_http_t *http, char *id, char **body, size_t *size);
 
 /**
  * Starts the cube. If it's already started this is a nop.
@@ -0,0 +1,679 @@
+/**
+ * lyftcube-loadtest: replays a mix of list, download, upload and play
+ * requests against a locally running lyftcube-server from several concurrent
+ * clients (as phones would), and reports throughput, p50/p99 latency and
+ * error rate per request type along with the server's RSS.
+ *
+ * The server signals lyftcube (killall -HUP) on every play and upload, so a
+ * stand-in process named "lyftcube" is started to receive those signals
+ * instead of the real cube. Uploaded animations are named loadtest-<client>
+ * and removed at the end, and the animation that was playing before the test
+ * is played again.
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS         64
+#define MAX_ANIMATIONS      100
+#define MAX_NAME            256
+#define MAX_UPLOAD_LENGTH   (1024 * 1024 * 10)
+#define RESPONSE_TIMEOUT_S  10
+#define RSS_INTERVAL_US     100000
+
+/// Written by the server on every play (see endpoints.c).
+#define CURRENT_ANIMATION_FILE \
+    "/opt/lyft/lyftcube/cube/animations/current_animation"
+
+enum RequestType {
+    REQUEST_LIST,
+    REQUEST_DOWNLOAD,
+    REQUEST_UPLOAD,
+    REQUEST_PLAY,
+    REQUEST_TYPES,
+};
+
+static const char *request_names[REQUEST_TYPES] = {
+    "list", "download", "upload", "play",
+};
+
+/// Latencies (in microseconds) and errors of one request type.
+struct Samples {
+    uint32_t *latencies;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t errors;
+    uint64_t bytes;
+};
+
+struct Client {
+    pthread_t thread;
+    uint8_t index;
+    unsigned int seed;
+    struct Samples samples[REQUEST_TYPES];
+};
+
+struct LoadTest {
+    struct sockaddr_in address;
+    uint32_t mix[REQUEST_TYPES];
+    uint32_t mix_total;
+    uint64_t deadline;
+
+    char animations[MAX_ANIMATIONS][MAX_NAME];
+    uint8_t animations_count;
+    char *gif;
+    size_t gif_size;
+};
+
+/// Signals received by the stand-in lyftcube (shared with the child).
+struct StandIn {
+    pid_t pid;
+    uint32_t reloads;
+    uint32_t overlays;
+};
+
+static struct LoadTest test;
+static struct StandIn *stand_in;
+
+// --- Helpers ----
+
+static uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void add_sample(struct Samples *samples, uint32_t latency) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->latencies = realloc(samples->latencies,
+                                     samples->capacity * sizeof(uint32_t));
+    }
+
+    samples->latencies[samples->count++] = latency;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Returns the resident set size of the given process in KB, or 0 if it's
+ * not running.
+ */
+static uint32_t process_rss(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    uint32_t rss = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "VmRSS: %u kB", &rss) == 1) {
+            break;
+        }
+    }
+
+    fclose(file);
+    return rss;
+}
+
+/**
+ * Finds the pid of the process with the given name, or 0.
+ */
+static pid_t find_process(const char *name) {
+    DIR *directory = opendir("/proc");
+    if (directory == NULL) {
+        return 0;
+    }
+
+    pid_t pid = 0;
+    struct dirent *entity;
+    while (pid == 0 && (entity = readdir(directory)) != NULL) {
+        char path[64 + MAX_NAME], comm[MAX_NAME] = "";
+        snprintf(path, sizeof(path), "/proc/%s/comm", entity->d_name);
+
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+
+        if (fgets(comm, sizeof(comm), file) != NULL) {
+            comm[strcspn(comm, "\n")] = '\0';
+            if (strcmp(comm, name) == 0) {
+                pid = atoi(entity->d_name);
+            }
+        }
+
+        fclose(file);
+    }
+
+    closedir(directory);
+    return pid;
+}
+
+// --- HTTP ----
+
+/**
+ * Performs a request on a new connection (the server closes every
+ * connection after responding) and returns the HTTP status code, or -1 on
+ * network errors. The response body is stored in `body` (which must be
+ * freed) when it's not NULL.
+ */
+static int request(const char *method, const char *uri, const char *data,
+                   size_t data_size, char **body, size_t *body_size)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct timeval timeout = {.tv_sec = RESPONSE_TIMEOUT_S};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr *)&test.address,
+                sizeof(test.address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    char header[512 + MAX_NAME];
+    int header_size = snprintf(header, sizeof(header),
+        "%s %s HTTP/1.1\r\nHost: localhost\r\nContent-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", method, uri, data_size);
+
+    bool sent = send(fd, header, header_size, MSG_NOSIGNAL) == header_size;
+    for (size_t offset = 0; sent && offset < data_size;) {
+        ssize_t count = send(fd, data + offset, data_size - offset,
+                             MSG_NOSIGNAL);
+        sent = count > 0;
+        offset += sent ? count : 0;
+    }
+
+    size_t size = 0, capacity = 4096;
+    char *response = malloc(capacity);
+    ssize_t count = 0;
+    while (sent && (count = recv(fd, response + size, capacity - size, 0)) > 0)
+    {
+        size += count;
+        if (size == capacity) {
+            capacity *= 2;
+            response = realloc(response, capacity);
+        }
+    }
+
+    close(fd);
+
+    int status = -1;
+    char *content = memmem(response, size, "\r\n\r\n", 4);
+    if (!sent || count < 0 || content == NULL ||
+        sscanf(response, "HTTP/%*s %d", &status) != 1)
+    {
+        free(response);
+        return -1;
+    }
+
+    content += 4;
+    size -= content - response;
+    if (body != NULL) {
+        *body = malloc(size + 1);
+        memcpy(*body, content, size);
+        (*body)[size] = '\0';
+    }
+
+    if (body_size != NULL) {
+        *body_size = size;
+    }
+
+    free(response);
+    return status;
+}
+
+/**
+ * Escapes spaces the way the server expects them in ids.
+ */
+static void animation_uri(char *uri, size_t size, const char *prefix,
+                          const char *name)
+{
+    size_t length = snprintf(uri, size, "%s", prefix);
+    for (; *name != '\0' && length + 4 < size; name++) {
+        length += *name == ' ' ? sprintf(uri + length, "%%20") :
+                  sprintf(uri + length, "%c", *name);
+    }
+}
+
+// --- Stand-in lyftcube ----
+
+static void stand_in_reload(int signal) {
+    __atomic_add_fetch(&stand_in->reloads, 1, __ATOMIC_RELAXED);
+}
+
+static void stand_in_overlays(int signal) {
+    __atomic_add_fetch(&stand_in->overlays, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Forks a process named "lyftcube" that counts the signals the server sends
+ * to the cube.
+ */
+static bool start_stand_in(void) {
+    stand_in = mmap(NULL, sizeof(struct StandIn), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stand_in == MAP_FAILED) {
+        return false;
+    }
+
+    // Installed before forking so no signal can arrive before them; the
+    // server only signals processes named lyftcube, so not this one.
+    memset(stand_in, 0, sizeof(struct StandIn));
+    signal(SIGHUP, stand_in_reload);
+    signal(SIGUSR1, stand_in_overlays);
+
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+
+    // The stand-in dies with the load test, even if it crashes or is killed
+    // before stopping it.
+    if (pid == 0) {
+        prctl(PR_SET_NAME, "lyftcube");
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != parent) {
+            _exit(EXIT_SUCCESS);
+        }
+
+        while (1) {
+            pause();
+        }
+    }
+
+    stand_in->pid = pid;
+    return true;
+}
+
+// --- Clients ----
+
+static enum RequestType pick_request(struct Client *client) {
+    uint32_t value = rand_r(&client->seed) % test.mix_total;
+    for (uint8_t type = 0; type < REQUEST_TYPES; type++) {
+        if (value < test.mix[type]) {
+            return type;
+        }
+
+        value -= test.mix[type];
+    }
+
+    return REQUEST_LIST;
+}
+
+static void *client_loop(void *context) {
+    struct Client *client = context;
+    char uri[MAX_NAME * 3 + 32], name[32];
+    snprintf(name, sizeof(name), "loadtest-%u", client->index);
+
+    while (monotonic_us() < test.deadline) {
+        enum RequestType type = pick_request(client);
+        const char *animation =
+            test.animations[rand_r(&client->seed) % test.animations_count];
+        const char *method = "GET", *data = NULL;
+        size_t data_size = 0, response_size = 0;
+
+        switch (type) {
+            case REQUEST_LIST:
+                snprintf(uri, sizeof(uri), "/animation/");
+                break;
+
+            case REQUEST_DOWNLOAD:
+                animation_uri(uri, sizeof(uri), "/animation/", animation);
+                break;
+
+            case REQUEST_UPLOAD:
+                method = "POST";
+                data = test.gif;
+                data_size = test.gif_size;
+                animation_uri(uri, sizeof(uri), "/animation/upload/", name);
+                break;
+
+            case REQUEST_PLAY:
+                method = "POST";
+                animation_uri(uri, sizeof(uri), "/animation/play/",
+                              animation);
+                break;
+
+            default:
+                continue;
+        }
+
+        uint64_t start = monotonic_us();
+        int status = request(method, uri, data, data_size, NULL,
+                             &response_size);
+        uint32_t latency = monotonic_us() - start;
+
+        struct Samples *samples = &client->samples[type];
+        add_sample(samples, latency);
+        samples->bytes += response_size;
+        if (status != 200) {
+            samples->errors++;
+        }
+    }
+
+    return NULL;
+}
+
+// --- Setup ----
+
+/**
+ * Parses a mix such as "list=60,download=20,upload=10,play=10".
+ */
+static bool parse_mix(char *mix) {
+    memset(test.mix, 0, sizeof(test.mix));
+    test.mix_total = 0;
+
+    for (char *item = strtok(mix, ","); item; item = strtok(NULL, ",")) {
+        char name[16];
+        uint32_t weight;
+        if (sscanf(item, "%15[a-z]=%u", name, &weight) != 2) {
+            return false;
+        }
+
+        uint8_t type = 0;
+        while (type < REQUEST_TYPES && strcmp(name, request_names[type])) {
+            type++;
+        }
+
+        if (type == REQUEST_TYPES) {
+            return false;
+        }
+
+        test.mix[type] = weight;
+        test.mix_total += weight;
+    }
+
+    return test.mix_total > 0;
+}
+
+/**
+ * Fetches the animations the clients will download and play.
+ */
+static bool fetch_animations(void) {
+    char *body;
+    size_t size;
+    if (request("GET", "/animation/", NULL, 0, &body, &size) != 200) {
+        return false;
+    }
+
+    // One animation per line: name,id,size
+    for (char *line = strtok(body, "\n"); line != NULL &&
+         test.animations_count < MAX_ANIMATIONS; line = strtok(NULL, "\n"))
+    {
+        char *comma = strchr(line, ',');
+        if (comma != NULL && strncmp(line, "loadtest-", 9) != 0) {
+            *comma = '\0';
+            snprintf(test.animations[test.animations_count++], MAX_NAME, "%s",
+                     line);
+        }
+    }
+
+    free(body);
+    return test.animations_count > 0;
+}
+
+/**
+ * Reads the name of the animation that is playing (the one lyftcube would
+ * load) so it can be played again after the test. Returns false when there
+ * is none.
+ */
+static bool read_current_animation(char *name, size_t size) {
+    FILE *file = fopen(CURRENT_ANIMATION_FILE, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    char path[MAX_NAME * 2] = "";
+    fgets(path, sizeof(path), file);
+    fclose(file);
+
+    // The file holds the path of the GIF: <animations>/<name>.gif
+    char *base = strrchr(path, '/');
+    base = base == NULL ? path : base + 1;
+    size_t length = strlen(base);
+    if (length <= 4 || strcmp(base + length - 4, ".gif") != 0) {
+        return false;
+    }
+
+    snprintf(name, size, "%.*s", (int)(length - 4), base);
+    return true;
+}
+
+/**
+ * Reads the GIF uploaded by the clients, or downloads the first animation
+ * from the server when no path is given.
+ */
+static bool load_gif(const char *path) {
+    if (path == NULL) {
+        char uri[MAX_NAME * 3 + 32];
+        animation_uri(uri, sizeof(uri), "/animation/", test.animations[0]);
+        return request("GET", uri, NULL, 0, &test.gif, &test.gif_size) == 200;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    test.gif = malloc(MAX_UPLOAD_LENGTH);
+    test.gif_size = fread(test.gif, 1, MAX_UPLOAD_LENGTH, file);
+    fclose(file);
+    return test.gif_size > 0;
+}
+
+// --- Report ----
+
+static void print_report(struct Client *clients, uint8_t clients_count,
+                         double elapsed)
+{
+    struct Samples total = {0};
+    printf("%-9s %8s %9s %10s %10s %8s %10s\n", "request", "count", "req/s",
+           "p50 (ms)", "p99 (ms)", "errors", "KB/s");
+
+    for (uint8_t type = 0; type <= REQUEST_TYPES; type++) {
+        struct Samples merged = {0};
+        for (uint8_t i = 0; type < REQUEST_TYPES && i < clients_count; i++) {
+            struct Samples *samples = &clients[i].samples[type];
+            for (uint32_t j = 0; j < samples->count; j++) {
+                add_sample(&merged, samples->latencies[j]);
+                add_sample(&total, samples->latencies[j]);
+            }
+
+            merged.errors += samples->errors;
+            merged.bytes += samples->bytes;
+            total.errors += samples->errors;
+            total.bytes += samples->bytes;
+        }
+
+        struct Samples *samples = type < REQUEST_TYPES ? &merged : &total;
+        if (samples->count == 0) {
+            continue;
+        }
+
+        qsort(samples->latencies, samples->count, sizeof(uint32_t),
+              compare_latencies);
+        printf("%-9s %8u %9.1f %10.2f %10.2f %7.1f%% %10.1f\n",
+               type < REQUEST_TYPES ? request_names[type] : "total",
+               samples->count, samples->count / elapsed,
+               samples->latencies[samples->count / 2] / 1e3,
+               samples->latencies[samples->count * 99 / 100] / 1e3,
+               100.0 * samples->errors / samples->count,
+               samples->bytes / 1024.0 / elapsed);
+        free(merged.latencies);
+    }
+
+    free(total.latencies);
+}
+
+// --- Main ----
+
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    fprintf(stderr, "  -c clients Concurrent clients (default 4)\n");
+    fprintf(stderr, "  -d seconds Duration of the test (default 10)\n");
+    fprintf(stderr, "  -m mix     Weight of each request (default "
+                    "list=60,download=20,upload=10,play=10)\n");
+    fprintf(stderr, "  -u file    GIF uploaded by the clients (default: "
+                    "the first animation on the server)\n");
+    fprintf(stderr, "  -p port    Server port on localhost (default 1337)\n");
+    fprintf(stderr, "  -P pid     Server pid for RSS (default: found by "
+                    "name)\n");
+}
+
+int main(int argc, char *argv[]) {
+    char default_mix[] = "list=60,download=20,upload=10,play=10";
+    char *mix = default_mix, *gif_path = NULL;
+    char current[MAX_NAME];
+    int concurrency = 4;
+    uint32_t duration = 10;
+    uint16_t port = 1337;
+    pid_t server = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "c:d:m:u:p:P:")) != -1) {
+        switch (option) {
+            case 'c': concurrency = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'm': mix = optarg; break;
+            case 'u': gif_path = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'P': server = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (concurrency < 1 || concurrency > MAX_CLIENTS || duration == 0 ||
+        !parse_mix(mix))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    uint8_t clients_count = concurrency;
+
+    test.address.sin_family = AF_INET;
+    test.address.sin_port = htons(port);
+    test.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    server = server ?: find_process("lyftcube-server");
+    if (server == 0) {
+        fprintf(stderr, "lyftcube-server isn't running\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!fetch_animations()) {
+        fprintf(stderr, "Can't list animations (at least one is needed)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (test.mix[REQUEST_UPLOAD] > 0 && !load_gif(gif_path)) {
+        fprintf(stderr, "Can't read the GIF to upload\n");
+        return EXIT_FAILURE;
+    }
+
+    if (find_process("lyftcube") != 0) {
+        fprintf(stderr, "lyftcube is running; stop it first, plays would "
+                        "reload it\n");
+        return EXIT_FAILURE;
+    }
+
+    // Plays and uploads change the animation lyftcube plays.
+    bool restore = read_current_animation(current, sizeof(current));
+    if (!start_stand_in()) {
+        fprintf(stderr, "Can't start the stand-in lyftcube\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Load test: %u clients for %u s against pid %d (%u animations, "
+           "%zu bytes uploads)\n", clients_count, duration, server,
+           test.animations_count, test.gif_size);
+
+    uint32_t rss_start = process_rss(server), rss_max = rss_start;
+    uint64_t start = monotonic_us();
+    test.deadline = start + duration * 1000000ULL;
+
+    struct Client clients[MAX_CLIENTS] = {{0}};
+    for (uint8_t i = 0; i < clients_count; i++) {
+        clients[i].index = i;
+        clients[i].seed = start + i;
+        pthread_create(&clients[i].thread, NULL, client_loop, &clients[i]);
+    }
+
+    while (monotonic_us() < test.deadline) {
+        usleep(RSS_INTERVAL_US);
+        uint32_t rss = process_rss(server);
+        rss_max = rss > rss_max ? rss : rss_max;
+    }
+
+    for (uint8_t i = 0; i < clients_count; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+
+    double elapsed = (monotonic_us() - start) / 1e6;
+    uint32_t rss_end = process_rss(server);
+
+    // Uploads are removed so they don't pile up in the animations folder.
+    for (uint8_t i = 0; test.mix[REQUEST_UPLOAD] && i < clients_count; i++) {
+        char uri[64];
+        snprintf(uri, sizeof(uri), "/animation/loadtest-%u", i);
+        request("DELETE", uri, NULL, 0, NULL, NULL);
+    }
+
+    kill(stand_in->pid, SIGTERM);
+    waitpid(stand_in->pid, NULL, 0);
+
+    // Played once the stand-in is gone so it doesn't count as a reload.
+    if (restore) {
+        char uri[MAX_NAME * 3 + 32];
+        animation_uri(uri, sizeof(uri), "/animation/play/", current);
+        if (request("POST", uri, NULL, 0, NULL, NULL) != 200) {
+            fprintf(stderr, "Can't play %s again\n", current);
+        }
+    }
+
+    print_report(clients, clients_count, elapsed);
+    printf("Server RSS: %u KB at start, %u KB max, %u KB at end\n", rss_start,
+           rss_max, rss_end);
+    printf("Stand-in lyftcube: %u reloads, %u overlay reloads\n",
+           stand_in->reloads, stand_in->overlays);
+
+    for (uint8_t i = 0; i < clients_count; i++) {
+        for (uint8_t type = 0; type < REQUEST_TYPES; type++) {
+            free(clients[i].samples[type].latencies);
+        }
+    }
+
+    free(test.gif);
+    return EXIT_SUCCESS;
+}
@@ -1,8 +1,10 @@
 #include <asyncd/asyncd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "endpoints.h"
+#include "metadata.h"
 
-#define ROUTES_COUNT    6
+#define ROUTES_COUNT    9
 
 static char *error_response = "ERROR";
 
@@ -10,61 +12,111 @@ struct Route {
     const char *method;
     const char *uri;
     bool (*function)(ad_http_t *http, char *id, char **body, size_t *size);
+
+    // Optional, for bodies handled while they arrive (see `receive_upload`):
+    // `receive` gets every read along with the state it keeps on the
+    // connection, and `finish` replaces `function` once the body is done.
+    bool (*receive)(ad_http_t *http, char *id, void **state);
+    bool (*finish)(ad_http_t *http, char *id, void *state, char **body,
+                   size_t *size);
+    ad_userdata_free_cb release;
 };
 
 
 // ----------- Handler -----------
 
+/**
+ * Returns the route of the request (or NULL) and stores its id, if any, on
+ * `id`.
+ */
+static struct Route *find_route(struct Route *routes, ad_http_t *http,
+                                char **id)
+{
+    for (uint8_t i = 0; i < ROUTES_COUNT; i++) {
+        struct Route *route = &routes[i];
+        size_t uri_len = strlen(route->uri);
+        if (strcmp(route->method, http->request.method) == 0 &&
+            strncmp(route->uri, http->request.uri, uri_len) == 0)
+        {
+            *id = strlen(http->request.uri) > uri_len ?
+                &http->request.uri[uri_len] : NULL;
+            if (*id != NULL) {
+                qstrreplace("sr", *id, "%20", " ");
+            }
+
+            return route;
+        }
+    }
+
+    return NULL;
+}
+
 int api_handler(short event, ad_conn_t *conn, void *userdata) {
-    if (event & AD_EVENT_READ && ad_http_get_status(conn) == AD_HTTP_REQ_DONE)
+    int status = ad_http_get_status(conn);
+    if (!(event & AD_EVENT_READ) ||
+        (status != AD_HTTP_REQ_HEADER_DONE && status != AD_HTTP_REQ_DONE))
     {
-        struct Route *routes = (struct Route *)userdata;
-        ad_http_t *http = (ad_http_t *)ad_conn_get_extra(conn);
-        bool response_ok = false;
-        char *body = error_response;
-        size_t body_size = 5;
-
-        for (uint8_t i = 0; i < ROUTES_COUNT; i++) {
-            struct Route route = routes[i];
-            size_t uri_len = strlen(route.uri);
-            if (strcmp(route.method, http->request.method) == 0 &&
-                strncmp(route.uri, http->request.uri, uri_len) == 0)
-            {
-                char *id = strlen(http->request.uri) > uri_len ?
-                    &http->request.uri[uri_len] : NULL;
-                if (id != NULL) {
-                    qstrreplace("sr", id, "%20", " ");
-                }
-
-                response_ok = route.function(http, id, &body, &body_size);
-                break;
-            }
+        return AD_OK;
+    }
+
+    ad_http_t *http = (ad_http_t *)ad_conn_get_extra(conn);
+    char *id = NULL;
+    struct Route *route = find_route((struct Route *)userdata, http, &id);
+    bool response_ok = false;
+    char *body = error_response;
+    size_t body_size = 5;
+
+    // Streamed bodies are refused as soon as they turn out to be invalid.
+    if (route != NULL && route->receive != NULL) {
+        void *state = ad_conn_get_userdata(conn);
+        response_ok = route->receive(http, id, &state);
+        if (state != ad_conn_get_userdata(conn)) {
+            ad_conn_set_userdata(conn, state, route->release);
+        }
+
+        if (response_ok && status != AD_HTTP_REQ_DONE) {
+            return AD_OK;
         }
 
-        int code = response_ok ? 200 : 500;
-        ad_http_response(conn, code, "text/plain", body, body_size);
-        if (body != error_response) {
-            free(body);
+        if (response_ok) {
+            response_ok = route->finish(http, id, state, &body, &body_size);
         }
+    } else if (status != AD_HTTP_REQ_DONE) {
+        return AD_OK;
+    } else if (route != NULL) {
+        response_ok = route->function(http, id, &body, &body_size);
+    }
 
-        return AD_CLOSE;
+    int code = response_ok ? 200 : 500;
+    ad_http_response(conn, code, "text/plain", body, body_size);
+    if (body != error_response) {
+        free(body);
     }
 
-    return AD_OK;
+    return AD_CLOSE;
 }
 
 // ----------- Main -----------
 
 int main(int argc, char **argv) {
     struct Route routes[ROUTES_COUNT] = {
-        {"POST", "/animation/upload/", upload},
+        {"GET", "/animation/meta/", metadata},
+        {"GET", "/animation/preview/", preview},
+        {"POST", "/animation/upload/", NULL, receive_upload, upload,
+         free_upload},
         {"POST", "/animation/play/", play_animation},
         {"GET", "/animation/", animation},
+        {"POST", "/overlays", overlays},
         {"POST", "/start", start},
         {"POST", "/stop", stop},
         {"DELETE", "/animation/", delete},
     };
 
+    // Extract the animations' metadata and previews ahead of the requests.
+    if (!start_metadata_cache(ANIMATIONS_PATH)) {
+        return EXIT_FAILURE;
+    }
+
     ad_server_t *server = ad_server_new();
     ad_server_set_option(server, "server.port", "1337");
     ad_server_register_hook(server, ad_http_handler, NULL);
@@ -0,0 +1,592 @@
+#include <dirent.h>
+#include <errno.h>
+#include <gif_lib.h>
+#include <linux/limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "metadata.h"
+#include "../frames.h"
+#include "../parser.h"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define WIDTH               8
+#define HEIGHT              64
+#define PIXELS              (WIDTH * HEIGHT)
+
+/// Colors quantized to 4 bits per component (as displayed by the cube).
+#define CUBE_COLORS         4096
+
+struct Metadata {
+    uint32_t frames;
+    uint32_t duration_ms;
+    uint8_t brightness;
+    uint32_t palette[PALETTE_SIZE];
+    uint8_t palette_count;
+};
+
+/// Serializes the extractions (from the cache thread and from uploads).
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Posted to have the cache thread look for stale animations again.
+static sem_t cache_requested;
+static bool cache_started = false;
+
+// --- Helpers ----
+
+/**
+ * Stores on `path` (PATH_MAX bytes) the path of a cache file by swapping the
+ * ".gif" extension of the animation path with the given one.
+ */
+static char *cache_path(const char *gif_path, const char *extension,
+                        char *path)
+{
+    size_t length = strlen(gif_path);
+    if (length < 4 || length - 4 + strlen(extension) >= PATH_MAX) {
+        return NULL;
+    }
+
+    memcpy(path, gif_path, length - 4);
+    strcpy(path + length - 4, extension);
+    return path;
+}
+
+/**
+ * Returns true when the cache file exists and is newer than the animation.
+ */
+static bool is_fresh(const char *gif_path, const char *extension) {
+    struct stat gif_stats, cache_stats;
+    char buffer[PATH_MAX];
+    char *path = cache_path(gif_path, extension, buffer);
+    return path != NULL && stat(gif_path, &gif_stats) == 0 &&
+           stat(path, &cache_stats) == 0 &&
+           cache_stats.st_mtime >= gif_stats.st_mtime;
+}
+
+/**
+ * Returns true when both the metadata and the preview are cached.
+ */
+static bool is_cached(const char *gif_path) {
+    return is_fresh(gif_path, ".meta") && is_fresh(gif_path, ".preview");
+}
+
+/**
+ * Asks the cache thread to extract the stale animations (see
+ * `start_metadata_cache`).
+ */
+static void request_refresh(void) {
+    if (cache_started) {
+        sem_post(&cache_requested);
+    }
+}
+
+/**
+ * Returns the color (4 bits per component, as displayed by the cube) of an
+ * RGB pixel.
+ */
+static uint16_t cube_color(const uint8_t *rgb, uint8_t max_red) {
+    return MIN(convert_to_4bits(rgb[0]), max_red) << 8 |
+           convert_to_4bits(rgb[1]) << 4 | convert_to_4bits(rgb[2]);
+}
+
+// --- Compositing ----
+
+/**
+ * Draws a frame on top of the canvas (RGB, WIDTH x HEIGHT) the way GIF
+ * decoders do: only its rectangle is drawn and its transparent pixels keep
+ * what was below them.
+ */
+static void draw(GifFileType *gif, int index, int transparent,
+                 uint8_t *canvas)
+{
+    SavedImage *image = &gif->SavedImages[index];
+    GifImageDesc *desc = &image->ImageDesc;
+    ColorMapObject *color_map = desc->ColorMap ?: gif->SColorMap;
+    if (color_map == NULL) {
+        return;
+    }
+
+    for (int y = desc->Top, i = 0; y < desc->Top + desc->Height; y++) {
+        for (int x = desc->Left; x < desc->Left + desc->Width; x++) {
+            GifByteType color_index = image->RasterBits[i++];
+            if (x >= WIDTH || y >= HEIGHT || color_index == transparent) {
+                continue;
+            }
+
+            GifColorType color = color_map->Colors[
+                MIN(color_index, color_map->ColorCount - 1)];
+            uint8_t *pixel = &canvas[(x + y * WIDTH) * 3];
+            pixel[0] = color.Red;
+            pixel[1] = color.Green;
+            pixel[2] = color.Blue;
+        }
+    }
+}
+
+/**
+ * Clears the frame's rectangle (to black, LEDs off) or restores the canvas
+ * to what it was before the frame, as its disposal mode says.
+ */
+static void dispose(GifFileType *gif, int index, int mode, uint8_t *canvas,
+                    const uint8_t *previous)
+{
+    GifImageDesc *desc = &gif->SavedImages[index].ImageDesc;
+    if (mode == DISPOSE_PREVIOUS) {
+        memcpy(canvas, previous, PIXELS * 3);
+        return;
+    }
+
+    if (mode != DISPOSE_BACKGROUND) {
+        return;
+    }
+
+    int bottom = MIN(desc->Top + desc->Height, HEIGHT);
+    int right = MIN(desc->Left + desc->Width, WIDTH);
+    for (int y = desc->Top; y < bottom; y++) {
+        for (int x = desc->Left; x < right; x++) {
+            memset(&canvas[(x + y * WIDTH) * 3], 0, 3);
+        }
+    }
+}
+
+// --- Extraction ----
+
+/**
+ * Composites every frame and computes the metadata from what the cube
+ * displays. Up to `PREVIEW_FRAMES` frames are evenly sampled for the preview
+ * along the way; each one lasts as long as the frames it stands for.
+ */
+static void extract(GifFileType *gif, struct Metadata *metadata,
+                    GifByteType *rasters, ColorMapObject **maps,
+                    uint16_t *delays)
+{
+    static uint32_t counts[CUBE_COLORS];
+    memset(counts, 0, sizeof(counts));
+    memset(metadata, 0, sizeof(struct Metadata));
+
+    uint8_t canvas[PIXELS * 3] = {0}, previous[PIXELS * 3];
+    uint16_t delay = 3;
+    double brightness = 0;
+    uint64_t total_cs = 0;
+
+    int count = MIN(gif->ImageCount, PREVIEW_FRAMES);
+    int sample = 0;
+
+    metadata->frames = gif->ImageCount;
+    for (int frame_index = 0; frame_index < gif->ImageCount; frame_index++) {
+        SavedImage *image = &gif->SavedImages[frame_index];
+        delay = find_delay_time(image, delay);
+        uint16_t duration = delay > 1 ? delay : DEFAULT_DELAY_MS / 10;
+        total_cs += duration;
+
+        GraphicsControlBlock GCB = {
+            .DisposalMode = DISPOSAL_UNSPECIFIED,
+            .TransparentColor = NO_TRANSPARENT_COLOR
+        };
+        DGifSavedExtensionToGCB(gif, frame_index, &GCB);
+        if (GCB.DisposalMode == DISPOSE_PREVIOUS) {
+            memcpy(previous, canvas, sizeof(canvas));
+        }
+
+        draw(gif, frame_index, GCB.TransparentColor, canvas);
+
+        uint32_t frame_sum = 0;
+        for (int i = 0; i < PIXELS; i++) {
+            uint16_t color = cube_color(&canvas[i * 3], MAX_RED_BRIGHTNESS);
+            counts[color] += duration;
+            frame_sum += (color >> 8) + ((color >> 4) & 0xf) + (color & 0xf);
+        }
+
+        brightness += (double)frame_sum * duration;
+
+        if (sample < count &&
+            frame_index == sample * gif->ImageCount / count)
+        {
+            maps[sample] = make_color_map(canvas, MAX_RED_BRIGHTNESS,
+                                          &rasters[sample * PIXELS]);
+            sample++;
+        }
+        delays[sample - 1] += duration;
+
+        dispose(gif, frame_index, GCB.DisposalMode, canvas, previous);
+    }
+
+    metadata->duration_ms = total_cs * 10;
+    if (total_cs > 0) {
+        brightness /= (double)total_cs * PIXELS * 3;
+        metadata->brightness = lround(brightness * 17);
+    }
+
+    // Most used colors, skipping black (LEDs off).
+    for (uint8_t i = 0; i < PALETTE_SIZE; i++) {
+        uint16_t best = 0;
+        for (uint16_t color = 1; color < CUBE_COLORS; color++) {
+            if (counts[color] > counts[best]) {
+                best = color;
+            }
+        }
+
+        if (best == 0 || counts[best] == 0) {
+            break;
+        }
+
+        counts[best] = 0;
+        metadata->palette[metadata->palette_count++] =
+            ((best >> 8) & 0xf) * 0x110000 + ((best >> 4) & 0xf) * 0x1100 +
+            (best & 0xf) * 0x11;
+    }
+}
+
+// --- Exposed functions ----
+
+/**
+ * Makes the local color map of a frame (RGB, 3 bytes per pixel) with one
+ * entry per distinct color as displayed by the cube, and the raster that
+ * indexes it. Frames with more than 256 of those colors are reduced to
+ * 3-3-2 bits instead.
+ *
+ * - parameter rgb:     The WIDTH x HEIGHT pixels of the frame.
+ * - parameter max_red: The red brightness limit (0-15) of the colors, use
+ *                      MAX_RED_BRIGHTNESS to get them as the cube shows
+ *                      them or 15 to keep the red as it is.
+ * - parameter raster:  A buffer where the frame's color indexes will be
+ *                      stored.
+ */
+ColorMapObject *make_color_map(const uint8_t *rgb, uint8_t max_red,
+                               GifByteType *raster)
+{
+    int16_t indexes[CUBE_COLORS];
+    memset(indexes, -1, sizeof(indexes));
+
+    GifColorType colors[256] = {{0}};
+    int count = 0;
+    for (uint16_t i = 0; i < PIXELS && count <= 256; i++) {
+        uint16_t color = cube_color(&rgb[i * 3], max_red);
+        if (indexes[color] < 0 && count++ < 256) {
+            indexes[color] = count - 1;
+            colors[count - 1] = (GifColorType) {
+                (color >> 8) * 17, ((color >> 4) & 0xf) * 17,
+                (color & 0xf) * 17
+            };
+        }
+
+        raster[i] = indexes[color];
+    }
+
+    if (count > 256) {
+        for (int i = 0; i < 256; i++) {
+            colors[i] = (GifColorType) {
+                (i >> 5) * 255 / 7, ((i >> 2) & 7) * 255 / 7, (i & 3) * 85
+            };
+        }
+
+        for (uint16_t i = 0; i < PIXELS; i++) {
+            uint16_t color = cube_color(&rgb[i * 3], max_red);
+            raster[i] = (color >> 9) << 5 | ((color >> 5) & 7) << 2 |
+                        (color & 0xf) >> 2;
+        }
+
+        return GifMakeMapObject(256, colors);
+    }
+
+    // Color maps have a power of two entries (2 at least).
+    return GifMakeMapObject(1 << GifBitSize(count), colors);
+}
+
+/**
+ * Writes an 8x64 GIF that loops forever, made of full frames with their own
+ * color map (see `make_color_map`). The color maps are freed.
+ *
+ * - parameter path:    The path of the GIF file.
+ * - parameter count:   The number of frames.
+ * - parameter rasters: The color indexes of every frame, one after another.
+ * - parameter maps:    The color map of every frame.
+ * - parameter delays:  The delay of every frame, in centiseconds.
+ */
+bool write_gif(const char *path, uint32_t count, GifByteType *rasters,
+               ColorMapObject **maps, uint16_t *delays)
+{
+    int error = 0;
+    GifFileType *gif = path ? EGifOpenFileName(path, false, &error) : NULL;
+    if (gif == NULL) {
+        fprintf(stderr, "Can't create %s (%s)\n", path,
+                GifErrorString(error));
+        for (uint32_t i = 0; i < count; i++) {
+            GifFreeMapObject(maps[i]);
+        }
+        return false;
+    }
+
+    gif->SWidth = WIDTH;
+    gif->SHeight = HEIGHT;
+    gif->SColorResolution = 8;
+    gif->SBackGroundColor = 0;
+
+    // Loop forever (NETSCAPE2.0 application extension)
+    unsigned char loop[] = {1, 0, 0};
+    GifAddExtensionBlock(&gif->ExtensionBlockCount, &gif->ExtensionBlocks,
+                         APPLICATION_EXT_FUNC_CODE, 11,
+                         (unsigned char *)"NETSCAPE2.0");
+    GifAddExtensionBlock(&gif->ExtensionBlockCount, &gif->ExtensionBlocks,
+                         CONTINUE_EXT_FUNC_CODE, sizeof(loop), loop);
+
+    for (uint32_t i = 0; i < count; i++) {
+        SavedImage image = {
+            .ImageDesc = {
+                .Left = 0, .Top = 0, .Width = WIDTH, .Height = HEIGHT,
+                .Interlace = false, .ColorMap = maps[i]
+            },
+            .RasterBits = &rasters[i * PIXELS]
+        };
+
+        // GifMakeSavedImage copies the color map and the raster.
+        GifMakeSavedImage(gif, &image);
+        GifFreeMapObject(maps[i]);
+
+        GraphicsControlBlock GCB = {
+            .DisposalMode = DISPOSE_DO_NOT, .UserInputFlag = false,
+            .DelayTime = delays[i], .TransparentColor = NO_TRANSPARENT_COLOR
+        };
+        EGifGCBToSavedExtension(&GCB, gif, i);
+    }
+
+    // EGifSpew also closes (and frees) the GIF.
+    if (EGifSpew(gif) == GIF_ERROR) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Writes the metadata line of an animation on the given path.
+ */
+static bool write_metadata(const char *path, struct Metadata *metadata) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+
+    fprintf(file, "%u,%u,%u,", metadata->frames, metadata->duration_ms,
+            metadata->brightness);
+    for (uint8_t i = 0; i < metadata->palette_count; i++) {
+        fprintf(file, i == 0 ? "%06x" : " %06x", metadata->palette[i]);
+    }
+    fprintf(file, "\n");
+    return fclose(file) == 0;
+}
+
+/**
+ * Extracts (and caches) the metadata and preview of the given animation.
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+bool refresh_metadata(const char *gif_path) {
+    char meta[PATH_MAX], preview[PATH_MAX];
+    char meta_tmp[PATH_MAX + 4], preview_tmp[PATH_MAX + 4];
+    if (cache_path(gif_path, ".meta", meta) == NULL ||
+        cache_path(gif_path, ".preview", preview) == NULL)
+    {
+        return false;
+    }
+
+    // The cache files are written aside and renamed into place, so readers
+    // never see half written ones.
+    snprintf(meta_tmp, sizeof(meta_tmp), "%s.tmp", meta);
+    snprintf(preview_tmp, sizeof(preview_tmp), "%s.tmp", preview);
+
+    pthread_mutex_lock(&refresh_lock);
+
+    int error = 0;
+    GifFileType *gif = DGifOpenFileName(gif_path, &error);
+    if (gif == NULL || DGifSlurp(gif) != GIF_OK || gif->ImageCount == 0) {
+        error = gif == NULL ? error : gif->Error;
+        fprintf(stderr, "Error reading GIF file %s (%s).\n", gif_path,
+                GifErrorString(error));
+
+        DGifCloseFile(gif, NULL);
+        pthread_mutex_unlock(&refresh_lock);
+        return false;
+    }
+
+    int count = MIN(gif->ImageCount, PREVIEW_FRAMES);
+    GifByteType rasters[PREVIEW_FRAMES * PIXELS];
+    ColorMapObject *maps[PREVIEW_FRAMES];
+    uint16_t delays[PREVIEW_FRAMES] = {0};
+
+    struct Metadata metadata;
+    extract(gif, &metadata, rasters, maps, delays);
+    DGifCloseFile(gif, NULL);
+
+    // Raw uploads keep their milliseconds in their frames; the GIF only has
+    // them rounded to centiseconds.
+    struct Animation animation;
+    if (load_frames(gif_path, &animation)) {
+        uint64_t duration_ms = 0;
+        for (uint32_t i = 0; i < animation.frames_count; i++) {
+            duration_ms += animation.frames[i].duration;
+        }
+
+        metadata.duration_ms = MIN(duration_ms, UINT32_MAX);
+        free(animation.frames);
+    }
+
+    bool success = write_gif(preview_tmp, count, rasters, maps, delays) &&
+                   write_metadata(meta_tmp, &metadata) &&
+                   rename(preview_tmp, preview) == 0 &&
+                   rename(meta_tmp, meta) == 0;
+    if (!success) {
+        remove(preview_tmp);
+        remove(meta_tmp);
+    }
+
+    pthread_mutex_unlock(&refresh_lock);
+    if (success) {
+        printf("Extracted metadata of %s\n", gif_path);
+    }
+
+    return success;
+}
+
+/**
+ * Reads the cached metadata line of the given animation (without the
+ * trailing newline). Animations that aren't cached yet are handed to the
+ * cache thread and fail until it has extracted them.
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ * - parameter line:     A buffer where the metadata line will be stored.
+ * - parameter size:     The size of the buffer.
+ */
+bool read_metadata(const char *gif_path, char *line, size_t size) {
+    char path[PATH_MAX];
+    if (!is_cached(gif_path)) {
+        request_refresh();
+        return false;
+    }
+
+    FILE *file = fopen(cache_path(gif_path, ".meta", path), "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    bool success = fgets(line, size, file) != NULL;
+    fclose(file);
+
+    char *newline;
+    if (success && (newline = strchr(line, '\n')) != NULL) {
+        *newline = '\0';
+    }
+
+    return success;
+}
+
+/**
+ * Returns the path of the cached preview of the given animation or NULL if
+ * it isn't cached yet (it's then handed to the cache thread, see
+ * `read_metadata`).
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+char *preview_path(const char *gif_path) {
+    static char path[PATH_MAX];
+    if (!is_cached(gif_path)) {
+        request_refresh();
+        return NULL;
+    }
+
+    return cache_path(gif_path, ".preview", path);
+}
+
+/**
+ * Removes the cached metadata and preview of the given animation.
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+void remove_metadata(const char *gif_path) {
+    char path[PATH_MAX];
+    if (cache_path(gif_path, ".meta", path) != NULL) {
+        remove(path);
+    }
+
+    if (cache_path(gif_path, ".preview", path) != NULL) {
+        remove(path);
+    }
+}
+
+// --- Cache thread ----
+
+/**
+ * Extracts every animation of the directory whose cache is missing or older
+ * than its GIF, then waits to be asked again (see `request_refresh`).
+ */
+static void *cache_animations(void *context) {
+    const char *directory = context;
+    char path[PATH_MAX];
+
+    while (true) {
+        DIR *animations = opendir(directory);
+        struct dirent *entity;
+        while (animations != NULL && (entity = readdir(animations)) != NULL) {
+            size_t length = strlen(entity->d_name);
+            if (length <= 4 || strcmp(entity->d_name + length - 4, ".gif") ||
+                snprintf(path, sizeof(path), "%s%s", directory,
+                         entity->d_name) >= sizeof(path))
+            {
+                continue;
+            }
+
+            if (!is_cached(path)) {
+                refresh_metadata(path);
+            }
+        }
+
+        if (animations != NULL) {
+            closedir(animations);
+        }
+
+        // Every miss posts once; the misses that piled up during the scan
+        // need a single scan more.
+        int waited;
+        do {
+            waited = sem_wait(&cache_requested);
+        } while (waited != 0 && errno == EINTR);
+
+        while (sem_trywait(&cache_requested) == 0) {
+            continue;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the thread that keeps the metadata and previews of the animations
+ * in the given directory cached: every stale one is extracted right away,
+ * and again whenever a request misses the cache, so requests never decode
+ * GIFs themselves.
+ *
+ * - parameter directory: The animations directory (with a trailing slash).
+ */
+bool start_metadata_cache(const char *directory) {
+    sem_init(&cache_requested, 0, 0);
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, cache_animations,
+                               (void *)directory);
+    if (error != 0) {
+        fprintf(stderr, "Can't start the metadata cache (%s)\n",
+                strerror(error));
+        return false;
+    }
+
+    pthread_detach(thread);
+    cache_started = true;
+    return true;
+}
@@ -0,0 +1,103 @@
+#include <gif_lib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Maximum number of frames sampled (evenly) into an animation's preview.
+#define PREVIEW_FRAMES      16
+
+/// Number of most used colors reported on the metadata.
+#define PALETTE_SIZE        8
+
+/**
+ * Metadata and previews are extracted once per upload and cached alongside
+ * the animation (<name>.meta and <name>.preview), so clients can show the
+ * animations list without downloading every GIF. Cached files older than
+ * their animation are extracted again by a background thread (see
+ * `start_metadata_cache`), never while serving a request.
+ *
+ * The metadata is a comma separated line as:
+ * frames,duration_ms,brightness,palette
+ *
+ * where brightness is the average brightness (0-255) as displayed by the
+ * cube and palette is a space separated list of the most used colors (as
+ * RRGGBB, quantized the way the cube displays them).
+ *
+ * The preview is a GIF with up to PREVIEW_FRAMES frames sampled from the
+ * animation; their delays add up to the animation's duration. Frames are
+ * composited into full canvases first (the way GIF decoders do), so
+ * animations made of partial frames are previewed correctly.
+ */
+
+/**
+ * Extracts (and caches) the metadata and preview of the given animation.
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+bool refresh_metadata(const char *gif_path);
+
+/**
+ * Starts the thread that keeps the metadata and previews of the animations
+ * in the given directory cached: every stale one is extracted right away,
+ * and again whenever a request misses the cache, so requests never decode
+ * GIFs themselves.
+ *
+ * - parameter directory: The animations directory (with a trailing slash).
+ */
+bool start_metadata_cache(const char *directory);
+
+/**
+ * Reads the cached metadata line of the given animation (without the
+ * trailing newline). Animations that aren't cached yet are handed to the
+ * cache thread and fail until it has extracted them.
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ * - parameter line:     A buffer where the metadata line will be stored.
+ * - parameter size:     The size of the buffer.
+ */
+bool read_metadata(const char *gif_path, char *line, size_t size);
+
+/**
+ * Returns the path of the cached preview of the given animation or NULL if
+ * it isn't cached yet (it's then handed to the cache thread, see
+ * `read_metadata`).
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+char *preview_path(const char *gif_path);
+
+/**
+ * Removes the cached metadata and preview of the given animation.
+ *
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+void remove_metadata(const char *gif_path);
+
+/**
+ * Makes the local color map of a frame (RGB, 3 bytes per pixel) with one
+ * entry per distinct color as displayed by the cube, and the raster that
+ * indexes it. Frames with more than 256 of those colors are reduced to
+ * 3-3-2 bits instead.
+ *
+ * - parameter rgb:     The WIDTH x HEIGHT pixels of the frame.
+ * - parameter max_red: The red brightness limit (0-15) of the colors, use
+ *                      MAX_RED_BRIGHTNESS to get them as the cube shows
+ *                      them or 15 to keep the red as it is.
+ * - parameter raster:  A buffer where the frame's color indexes will be
+ *                      stored.
+ */
+ColorMapObject *make_color_map(const uint8_t *rgb, uint8_t max_red,
+                               GifByteType *raster);
+
+/**
+ * Writes an 8x64 GIF that loops forever, made of full frames with their own
+ * color map (see `make_color_map`). The color maps are freed.
+ *
+ * - parameter path:    The path of the GIF file.
+ * - parameter count:   The number of frames.
+ * - parameter rasters: The color indexes of every frame, one after another.
+ * - parameter maps:    The color map of every frame.
+ * - parameter delays:  The delay of every frame, in centiseconds.
+ */
+bool write_gif(const char *path, uint32_t count, GifByteType *rasters,
+               ColorMapObject **maps, uint16_t *delays);
@@ -0,0 +1,397 @@
+#include <fcntl.h>
+#include <gif_lib.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "metadata.h"
+#include "raw.h"
+#include "../frames.h"
+#include "../parser.h"
+#include "../voxels.h"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+#define WIDTH               8
+#define HEIGHT              64
+#define HEADER_SIZE         8
+#define VOXELS              (WIDTH * HEIGHT)
+#define RAW_FRAME_SIZE      (2 + VOXELS * 3)
+#define CHUNK_SIZE          16384
+
+/**
+ * A range of frames converted by one thread. The output arrays are shared
+ * but every worker only writes its own frames.
+ */
+struct Worker {
+    pthread_t thread;
+    bool started;
+    uint8_t *data;
+    uint16_t first, last;
+
+    struct Frame *frames;
+    GifByteType *rasters;
+    ColorMapObject **maps;
+    uint16_t *delays;
+};
+
+/**
+ * A raw animation being received (see `receive_raw_animation`): its frames
+ * are read (and inflated) into `data` as they arrive, then converted into
+ * the animation and the frames of its GIF.
+ */
+struct RawUpload {
+    uint16_t frames_count;
+    bool compressed;
+    uint8_t *data;
+    size_t size, received;
+    z_stream stream;
+    bool ended;
+
+    struct Animation animation;
+    GifByteType *rasters;
+    ColorMapObject **maps;
+    uint16_t *delays;
+};
+
+// --- Helpers ----
+
+static uint16_t read_uint16(const uint8_t *bytes) {
+    return bytes[0] | (bytes[1] << 8);
+}
+
+static uint64_t elapsed_us(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000ULL +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * Validates the header of a raw animation and starts its upload, or returns
+ * NULL. Uncompressed animations must have exactly the length of their frames
+ * (when it's known).
+ */
+static struct RawUpload *start_upload(const uint8_t *header, size_t length) {
+    if (memcmp(header, RAW_MAGIC, sizeof(RAW_MAGIC) - 1) != 0 ||
+        header[4] != RAW_VERSION || (header[5] & ~RAW_COMPRESSED) != 0)
+    {
+        fprintf(stderr, "Invalid raw animation header\n");
+        return NULL;
+    }
+
+    uint16_t frames_count = read_uint16(&header[6]);
+    if (frames_count == 0 || frames_count > MAX_RAW_FRAMES) {
+        fprintf(stderr, "Invalid raw animation frames count %u\n",
+                frames_count);
+        return NULL;
+    }
+
+    bool compressed = header[5] & RAW_COMPRESSED;
+    size_t size = (size_t)frames_count * RAW_FRAME_SIZE;
+    if (!compressed && length != 0 && length != HEADER_SIZE + size) {
+        fprintf(stderr, "Invalid raw animation length %zu (%u frames "
+                        "expected)\n", length, frames_count);
+        return NULL;
+    }
+
+    struct RawUpload *upload = calloc(1, sizeof(struct RawUpload));
+    if (upload == NULL || (upload->data = malloc(size)) == NULL ||
+        (compressed && inflateInit(&upload->stream) != Z_OK))
+    {
+        free(upload != NULL ? upload->data : NULL);
+        free(upload);
+        return NULL;
+    }
+
+    upload->frames_count = frames_count;
+    upload->compressed = compressed;
+    upload->size = size;
+    upload->stream.next_out = upload->data;
+    upload->stream.avail_out = size;
+    return upload;
+}
+
+/**
+ * Reads the frames received so far into `data`, inflating them when needed.
+ * Fails as soon as there's more than the announced frames.
+ */
+static bool read_frames(struct RawUpload *upload, struct evbuffer *input) {
+    if (!upload->compressed) {
+        size_t length = evbuffer_get_length(input);
+        if (length > upload->size - upload->received) {
+            return false;
+        }
+
+        evbuffer_remove(input, upload->data + upload->received, length);
+        upload->received += length;
+        return true;
+    }
+
+    z_stream *stream = &upload->stream;
+    uint8_t chunk[CHUNK_SIZE];
+    int read;
+    while ((read = evbuffer_remove(input, chunk, sizeof(chunk))) > 0) {
+        if (upload->ended) {
+            return false;
+        }
+
+        stream->next_in = chunk;
+        stream->avail_in = read;
+        int status = inflate(stream, Z_NO_FLUSH);
+        upload->received = upload->size - stream->avail_out;
+
+        // Input left over means the output is full (more frames than
+        // announced) or that something follows the stream.
+        upload->ended = status == Z_STREAM_END;
+        if ((status != Z_OK && status != Z_BUF_ERROR && !upload->ended) ||
+            stream->avail_in > 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Converts a range of raw frames into bit planes and GIF frames.
+ */
+static void *convert_frames(void *context) {
+    struct Worker *worker = context;
+    for (uint16_t i = worker->first; i < worker->last; i++) {
+        uint8_t *raw = &worker->data[i * RAW_FRAME_SIZE];
+        uint8_t *rgb = raw + 2;
+
+        // The frames keep the milliseconds. GIF delays are centiseconds and
+        // players stretch the ones under 2 (see DEFAULT_DELAY_MS), so the GIF
+        // gets 2 at least.
+        uint16_t delay = read_uint16(raw);
+        struct Frame *frame = &worker->frames[i];
+        frame->duration = delay > 0 ? delay : DEFAULT_DELAY_MS;
+        worker->delays[i] = MAX((frame->duration + 5) / 10, 2);
+
+        for (uint16_t voxel = 0; voxel < VOXELS; voxel++) {
+            uint8_t *color = &rgb[voxel * 3];
+            uint8_t y = voxel / WIDTH, x = voxel % WIDTH;
+            set_color_led(frame, y / 8, y % 8, x, color[0], color[1],
+                          color[2]);
+        }
+
+        // The GIF keeps the colors as uploaded, the cube limits the red
+        // when it plays it.
+        worker->maps[i] = make_color_map(rgb, 0xf,
+                                         &worker->rasters[i * VOXELS]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Converts the raw frames on every available core.
+ */
+static void convert(uint8_t *data, struct Animation *animation,
+                    GifByteType *rasters, ColorMapObject **maps,
+                    uint16_t *delays, long *threads)
+{
+    long count = MIN(sysconf(_SC_NPROCESSORS_ONLN), animation->frames_count);
+    count = count < 1 ? 1 : count;
+
+    struct Worker workers[count];
+    for (long i = 0; i < count; i++) {
+        workers[i] = (struct Worker) {
+            .data = data, .frames = animation->frames, .rasters = rasters,
+            .maps = maps, .delays = delays,
+            .first = i * animation->frames_count / count,
+            .last = (i + 1) * animation->frames_count / count
+        };
+    }
+
+    // The first range is converted on this thread while the others run.
+    for (long i = 1; i < count; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL,
+                                            convert_frames, &workers[i]) == 0;
+        if (!workers[i].started) {
+            convert_frames(&workers[i]);
+        }
+    }
+
+    convert_frames(&workers[0]);
+    for (long i = 1; i < count; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    *threads = count;
+}
+
+// --- Exposed functions ----
+
+/**
+ * Returns true when the upload in the given buffer is a raw voxel animation
+ * (as opposed to a GIF).
+ *
+ * - parameter input: The request body.
+ */
+bool is_raw_animation(struct evbuffer *input) {
+    char magic[sizeof(RAW_MAGIC) - 1];
+    return evbuffer_copyout(input, magic, sizeof(magic)) == sizeof(magic) &&
+           memcmp(magic, RAW_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * Reads the part of a raw animation received so far (inflating it when
+ * needed) and drains it from the request body. The header is validated as
+ * soon as it arrives and the frames as they do, so an invalid upload is
+ * refused before the rest of it is received.
+ *
+ * - parameter upload: Where the upload is kept between calls. It must be
+ *                     NULL on the first call and it's created once the
+ *                     header arrives (see `free_raw_upload`).
+ * - parameter input:  The request body received so far.
+ * - parameter length: The length of the whole body, or 0 when unknown.
+ */
+bool receive_raw_animation(struct RawUpload **upload, struct evbuffer *input,
+                           size_t length)
+{
+    if (*upload == NULL) {
+        uint8_t header[HEADER_SIZE];
+        if (evbuffer_get_length(input) < sizeof(header)) {
+            return true;
+        }
+
+        evbuffer_remove(input, header, sizeof(header));
+        if ((*upload = start_upload(header, length)) == NULL) {
+            return false;
+        }
+    }
+
+    if (!read_frames(*upload, input)) {
+        fprintf(stderr, "Invalid raw animation (%u frames expected)\n",
+                (*upload)->frames_count);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Converts a completely received raw animation on every available core into
+ * the bit planes lyftcube loads directly (see ../frames.h) and stores them,
+ * so it can be played right away. Its GIF is written afterwards by
+ * `write_raw_gif`. Nothing is written when the animation is incomplete.
+ *
+ * - parameter upload:   The received animation.
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+bool convert_raw_animation(struct RawUpload *upload, const char *gif_path) {
+    if (upload->received != upload->size ||
+        (upload->compressed && !upload->ended))
+    {
+        fprintf(stderr, "Incomplete raw animation (%u frames expected)\n",
+                upload->frames_count);
+        return false;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint16_t frames_count = upload->frames_count;
+    upload->animation = (struct Animation) {
+        .frames = calloc(frames_count, sizeof(struct Frame)),
+        .frames_count = frames_count, .phases = 1
+    };
+    upload->rasters = malloc(frames_count * VOXELS);
+    upload->maps = calloc(frames_count, sizeof(ColorMapObject *));
+    upload->delays = calloc(frames_count, sizeof(uint16_t));
+
+    long threads;
+    convert(upload->data, &upload->animation, upload->rasters, upload->maps,
+            upload->delays, &threads);
+    free(upload->data);
+    upload->data = NULL;
+
+    bool success = save_frames(gif_path, &upload->animation);
+    printf("Converted %u raw frames in %.1f ms on %ld threads\n",
+           frames_count, elapsed_us(&start) / 1e3, threads);
+
+    return success;
+}
+
+/**
+ * Writes the GIF of a converted raw animation. It's dated like the frames,
+ * so lyftcube keeps loading them instead (GIF delays are rounded to
+ * centiseconds), and it's renamed into place once complete.
+ *
+ * - parameter upload:   The converted animation.
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+bool write_raw_gif(struct RawUpload *upload, const char *gif_path) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char temporary[PATH_MAX + 4], buffer[PATH_MAX];
+    char *frames = frames_path(gif_path, buffer);
+    struct stat frames_stats;
+    if (upload->maps == NULL || frames == NULL ||
+        stat(frames, &frames_stats) != 0)
+    {
+        return false;
+    }
+
+    // write_gif frees the color maps.
+    snprintf(temporary, sizeof(temporary), "%s.tmp", gif_path);
+    bool success = write_gif(temporary, upload->frames_count,
+                             upload->rasters, upload->maps, upload->delays);
+    free(upload->maps);
+    upload->maps = NULL;
+
+    struct timespec times[2] = {frames_stats.st_atim, frames_stats.st_mtim};
+    if (!success || utimensat(AT_FDCWD, temporary, times, 0) != 0 ||
+        rename(temporary, gif_path) != 0)
+    {
+        fprintf(stderr, "Can't write %s\n", gif_path);
+        remove(temporary);
+        return false;
+    }
+
+    printf("Wrote the GIF of %u raw frames in %.1f ms\n",
+           upload->frames_count, elapsed_us(&start) / 1e3);
+    return true;
+}
+
+/**
+ * Frees a raw animation upload.
+ *
+ * - parameter upload: The upload, or NULL.
+ */
+void free_raw_upload(struct RawUpload *upload) {
+    if (upload == NULL) {
+        return;
+    }
+
+    if (upload->compressed) {
+        inflateEnd(&upload->stream);
+    }
+
+    for (uint16_t i = 0; upload->maps != NULL && i < upload->frames_count;
+         i++)
+    {
+        GifFreeMapObject(upload->maps[i]);
+    }
+
+    free(upload->data);
+    free(upload->animation.frames);
+    free(upload->rasters);
+    free(upload->maps);
+    free(upload->delays);
+    free(upload);
+}
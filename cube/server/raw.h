@@ -0,0 +1,82 @@
+#include <event2/buffer.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Raw voxel animations can be uploaded instead of GIFs, which saves clients
+ * the palette quantization and the cube the GIF decoding. Everything is
+ * little endian:
+ *
+ * - Header: RAW_MAGIC, the version (1 byte, RAW_VERSION), flags (1 byte)
+ *           and the number of frames (uint16, up to MAX_RAW_FRAMES).
+ * - Frames: each one is its delay in milliseconds (uint16, 0 for
+ *           DEFAULT_DELAY_MS) followed by the RGB (3 bytes) of every voxel,
+ *           from the bottom level to the top one, row by row and column by
+ *           column (the same order as the GIF's pixels). The cube plays the
+ *           delays as given; the animation's GIF has them in centiseconds
+ *           (2 at least).
+ *
+ * When flags has RAW_COMPRESSED set, everything after the header is a zlib
+ * stream. Up to MAX_RAW_FRAMES frames (10 minutes at 10 frames per second)
+ * are accepted.
+ */
+#define RAW_MAGIC           "LCVX"
+#define RAW_VERSION         1
+#define RAW_COMPRESSED      0x01
+#define MAX_RAW_FRAMES      6000
+
+/**
+ * Returns true when the upload in the given buffer is a raw voxel animation
+ * (as opposed to a GIF).
+ *
+ * - parameter input: The request body.
+ */
+bool is_raw_animation(struct evbuffer *input);
+
+/**
+ * A raw animation being uploaded.
+ */
+struct RawUpload;
+
+/**
+ * Reads the part of a raw animation received so far (inflating it when
+ * needed) and drains it from the request body. The header is validated as
+ * soon as it arrives and the frames as they do, so an invalid upload is
+ * refused before the rest of it is received.
+ *
+ * - parameter upload: Where the upload is kept between calls. It must be
+ *                     NULL on the first call and it's created once the
+ *                     header arrives (see `free_raw_upload`).
+ * - parameter input:  The request body received so far.
+ * - parameter length: The length of the whole body, or 0 when unknown.
+ */
+bool receive_raw_animation(struct RawUpload **upload, struct evbuffer *input,
+                           size_t length);
+
+/**
+ * Converts a completely received raw animation on every available core into
+ * the bit planes lyftcube loads directly (see ../frames.h) and stores them,
+ * so it can be played right away. Its GIF is written afterwards by
+ * `write_raw_gif`. Nothing is written when the animation is incomplete.
+ *
+ * - parameter upload:   The received animation.
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+bool convert_raw_animation(struct RawUpload *upload, const char *gif_path);
+
+/**
+ * Writes the GIF of a converted raw animation. It's dated like the frames,
+ * so lyftcube keeps loading them instead (GIF delays are rounded to
+ * centiseconds), and it's renamed into place once complete.
+ *
+ * - parameter upload:   The converted animation.
+ * - parameter gif_path: The path of the animation's GIF file.
+ */
+bool write_raw_gif(struct RawUpload *upload, const char *gif_path);
+
+/**
+ * Frees a raw animation upload.
+ *
+ * - parameter upload: The upload, or NULL.
+ */
+void free_raw_upload(struct RawUpload *upload);
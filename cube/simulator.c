@@ -0,0 +1,496 @@
+/**
+ * lyftcube-sim: runs the refresh loop headless, as fast as possible, against
+ * a virtual cube. Every LED's on-time is integrated over the BAM cycles of
+ * each frame and turned into the RGB intensity a viewer would perceive.
+ * Virtual time advances as the refresh loop waits and as planes are shifted
+ * (SPI_LEVEL_NS each), so uneven slots show up as brightness errors.
+ *
+ * The per-frame results can be written as a text dump (used as golden output
+ * when the parser, BAM or scheduler change) or as PPM images, and the run
+ * doubles as a throughput benchmark of the refresh pipeline. It also reports
+ * the longest contiguous time each LED stayed dark, by perceived brightness,
+ * to compare the flicker of the BAM schedules.
+ */
+#include "animation.h"
+#include "interpolation.h"
+#include "parser.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LEVELS      8
+#define ROWS        8
+#define COLUMNS     8
+#define COLORS      3
+#define BRIGHTNESS  (1 << BAM_BITS)
+
+typedef uint8_t PerceivedFrame[LEVELS * ROWS][COLUMNS][COLORS];
+
+struct Simulator {
+    // Virtual hardware
+    uint8_t latched[24];
+    uint8_t lit_level;
+    bool lit;
+    uint64_t now;
+
+    // Integration (in nanoseconds) of the frame being displayed
+    uint64_t on_ns[LEVELS][ROWS][COLUMNS][COLORS];
+    uint64_t frame_ns;
+    uint32_t frame_index;
+
+    // The refresh loop moved to `next_frame_index`, but the last level of
+    // the previous frame stays lit until the next one is turned on.
+    bool frame_ended;
+    uint32_t next_frame_index;
+
+    // Longest dark run of every LED (in nanoseconds) during the current
+    // frame, and the worst one seen for each perceived brightness over the
+    // whole run. Runs are measured within a frame so content changes don't
+    // count.
+    uint64_t last_off[LEVELS][ROWS][COLUMNS][COLORS];
+    uint64_t max_gap[LEVELS][ROWS][COLUMNS][COLORS];
+    uint64_t max_gap_by_brightness[BRIGHTNESS];
+
+    // Run statistics
+    uint64_t total_slots;
+    uint32_t frames_done;
+    uint32_t frames_limit;
+    uint32_t mismatches;
+
+    // Outputs (all optional)
+    FILE *dump;
+    FILE *golden;
+    const char *images_path;
+    int tolerance;
+};
+
+static void finish_frame(struct Simulator *sim);
+
+// --- Virtual driver ----
+
+/**
+ * Advances the virtual clock: every LED of the lit level whose bit is
+ * latched gets the elapsed time as on-time.
+ */
+static void elapse(struct Simulator *sim, uint64_t until) {
+    if (until <= sim->now) {
+        return;
+    }
+
+    uint8_t level = sim->lit_level;
+    for (uint8_t color = 0; sim->lit && color < COLORS; color++) {
+        for (uint8_t y = 0; y < ROWS; y++) {
+            uint8_t row = sim->latched[y + color * ROWS];
+            for (uint8_t x = 0; row != 0 && x < COLUMNS; x++) {
+                if (((row >> x) & 1) == 0) {
+                    continue;
+                }
+
+                sim->on_ns[level][y][x][color] += until - sim->now;
+
+                // 0 means never lit (the clock is past 0 once lit).
+                uint64_t *last_off = &sim->last_off[level][y][x][color];
+                uint64_t *max_gap = &sim->max_gap[level][y][x][color];
+                uint64_t gap = sim->now - *last_off;
+                if (*last_off != 0 && gap > *max_gap) {
+                    *max_gap = gap;
+                }
+                *last_off = until;
+            }
+        }
+    }
+
+    sim->frame_ns += until - sim->now;
+    sim->now = until;
+}
+
+/**
+ * The lit level keeps showing the previous plane until the new one is
+ * completely shifted in.
+ */
+static void sim_latch(void *context, uint8_t *buffer) {
+    struct Simulator *sim = context;
+    elapse(sim, sim->now + SPI_LEVEL_NS);
+    memcpy(sim->latched, buffer, sizeof(sim->latched));
+}
+
+static void sim_show(void *context, uint8_t level, uint8_t bit, bool on) {
+    struct Simulator *sim = context;
+    if (sim->frame_ended) {
+        finish_frame(sim);
+    }
+
+    sim->lit_level = level;
+    sim->lit = on;
+    sim->total_slots++;
+}
+
+static void sim_wait(void *context, uint64_t deadline) {
+    elapse(context, deadline);
+}
+
+static uint64_t sim_clock(void *context) {
+    struct Simulator *sim = context;
+    return sim->now;
+}
+
+// --- Outputs ----
+
+/**
+ * Converts the integrated on-time into perceived intensities (0-255). A LED
+ * that is on for every slot of its level (1/8 of the time, because of the
+ * multiplexing) is perceived at full brightness.
+ */
+static void perceive(struct Simulator *sim, PerceivedFrame perceived) {
+    for (uint8_t level = 0; level < LEVELS; level++) {
+        for (uint8_t y = 0; y < ROWS; y++) {
+            for (uint8_t x = 0; x < COLUMNS; x++) {
+                for (uint8_t color = 0; color < COLORS; color++) {
+                    uint64_t on = sim->on_ns[level][y][x][color];
+                    uint64_t value = (on * LEVELS * 255 + sim->frame_ns / 2) /
+                                     sim->frame_ns;
+                    perceived[level * ROWS + y][x][color] =
+                        value > 255 ? 255 : value;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Folds the longest dark run of every LED on the frame that just ended into
+ * the worst run seen for the LED's perceived brightness.
+ */
+static void collect_gaps(struct Simulator *sim) {
+    for (uint8_t level = 0; level < LEVELS; level++) {
+        for (uint8_t y = 0; y < ROWS; y++) {
+            for (uint8_t x = 0; x < COLUMNS; x++) {
+                for (uint8_t color = 0; color < COLORS; color++) {
+                    uint64_t on = sim->on_ns[level][y][x][color];
+                    uint8_t brightness = (on * LEVELS * (BRIGHTNESS - 1) +
+                                          sim->frame_ns / 2) / sim->frame_ns;
+                    uint64_t gap = sim->max_gap[level][y][x][color];
+                    if (brightness < BRIGHTNESS &&
+                        gap > sim->max_gap_by_brightness[brightness])
+                    {
+                        sim->max_gap_by_brightness[brightness] = gap;
+                    }
+                }
+            }
+        }
+    }
+
+    memset(sim->max_gap, 0, sizeof(sim->max_gap));
+    memset(sim->last_off, 0, sizeof(sim->last_off));
+}
+
+static void write_dump(FILE *file, uint32_t index, PerceivedFrame perceived) {
+    fprintf(file, "# frame %u\n", index);
+    for (uint8_t y = 0; y < LEVELS * ROWS; y++) {
+        for (uint8_t x = 0; x < COLUMNS; x++) {
+            uint8_t *rgb = perceived[y][x];
+            fprintf(file, x == 0 ? "%02x%02x%02x" : " %02x%02x%02x",
+                    rgb[0], rgb[1], rgb[2]);
+        }
+        fprintf(file, "\n");
+    }
+}
+
+static void write_image(const char *directory, uint32_t sequence,
+                        PerceivedFrame perceived)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/frame_%05u.ppm", directory, sequence);
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Can't write image %s\n", path);
+        return;
+    }
+
+    fprintf(file, "P6\n%d %d\n255\n", COLUMNS, LEVELS * ROWS);
+    fwrite(perceived, 1, sizeof(PerceivedFrame), file);
+    fclose(file);
+}
+
+/**
+ * Compares the given frame with the next one in the golden file; every LED
+ * component off by more than the tolerance counts as a mismatch.
+ */
+static void compare_golden(struct Simulator *sim, uint32_t index,
+                           PerceivedFrame perceived)
+{
+    unsigned golden_index;
+    if (fscanf(sim->golden, " # frame %u", &golden_index) != 1) {
+        fprintf(stderr, "Golden output ended before frame %u\n", index);
+        sim->mismatches++;
+        return;
+    }
+
+    if (golden_index != index) {
+        fprintf(stderr, "Expected frame %u in golden output, got %u\n",
+                index, golden_index);
+        sim->mismatches++;
+    }
+
+    for (uint8_t y = 0; y < LEVELS * ROWS; y++) {
+        for (uint8_t x = 0; x < COLUMNS; x++) {
+            unsigned rgb;
+            if (fscanf(sim->golden, " %6x", &rgb) != 1) {
+                fprintf(stderr, "Truncated golden frame %u\n", index);
+                sim->mismatches++;
+                return;
+            }
+
+            for (uint8_t color = 0; color < COLORS; color++) {
+                int expected = (rgb >> (8 * (2 - color))) & 0xff;
+                int actual = perceived[y][x][color];
+                if (abs(expected - actual) > sim->tolerance) {
+                    fprintf(stderr, "Frame %u, y: %d, x: %d, color: %d "
+                            "expected %d got %d\n", index, y, x, color,
+                            expected, actual);
+                    sim->mismatches++;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Emits the perceived frame once all of its light has been integrated, and
+ * resets the integration.
+ */
+/**
+ * Counts every frame left in the golden file once the run is over as a
+ * mismatch, so a regression that plays fewer frames doesn't go unnoticed.
+ */
+static void finish_golden(struct Simulator *sim) {
+    unsigned golden_index, rgb;
+    while (fscanf(sim->golden, " # frame %u", &golden_index) == 1) {
+        fprintf(stderr, "Golden frame %u wasn't played\n", golden_index);
+        sim->mismatches++;
+        while (fscanf(sim->golden, " %6x", &rgb) == 1) {
+        }
+    }
+
+    if (fscanf(sim->golden, " %*c") != EOF) {
+        fprintf(stderr, "Unexpected content at the end of the golden "
+                        "output\n");
+        sim->mismatches++;
+    }
+}
+
+static void finish_frame(struct Simulator *sim) {
+    PerceivedFrame perceived;
+    perceive(sim, perceived);
+
+    if (sim->dump != NULL) {
+        write_dump(sim->dump, sim->frame_index, perceived);
+    }
+
+    if (sim->golden != NULL) {
+        compare_golden(sim, sim->frame_index, perceived);
+    }
+
+    if (sim->images_path != NULL) {
+        write_image(sim->images_path, sim->frames_done, perceived);
+    }
+
+    collect_gaps(sim);
+    memset(sim->on_ns, 0, sizeof(sim->on_ns));
+    sim->frame_ns = 0;
+    sim->frame_index = sim->next_frame_index;
+    sim->frame_ended = false;
+    sim->frames_done++;
+}
+
+/**
+ * Called by the refresh loop every time a frame is over; the frame is
+ * emitted when the next one is turned on.
+ */
+static bool sim_frame(void *context, uint32_t frame_index) {
+    struct Simulator *sim = context;
+    sim->frame_ended = true;
+    sim->next_frame_index = frame_index;
+    return sim->frames_done + 1 < sim->frames_limit;
+}
+
+// --- Main ----
+
+/**
+ * Parses a whole number option within [min, max].
+ */
+static bool parse_number(const char *text, long min, long max, long *value) {
+    char *end;
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    return end != text && *end == '\0' && errno == 0 && *value >= min &&
+           *value <= max;
+}
+
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s [options] animation.gif\n", name);
+    fprintf(stderr, "  -o file   Write perceived frames as text (- for "
+                    "stdout)\n");
+    fprintf(stderr, "  -g file   Compare perceived frames with a golden "
+                    "dump\n");
+    fprintf(stderr, "  -t value  Tolerance per color component when "
+                    "comparing (default 0)\n");
+    fprintf(stderr, "  -i dir    Write every perceived frame as a PPM "
+                    "image\n");
+    fprintf(stderr, "  -l loops  Number of times the animation is played "
+                    "(default 1)\n");
+    fprintf(stderr, "  -s speed  Playback speed multiplier (default 1.0)\n");
+    fprintf(stderr, "  -b mode   BAM schedule: binary (default) or "
+                    "interleaved\n");
+    fprintf(stderr, "  -f        Fade every frame into the next one\n");
+    fprintf(stderr, "  -d        Temporal dithering of the 8 bits colors "
+                    "(not with -f)\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct Simulator sim = {0};
+    static struct Interpolator interpolator;
+    struct Options options = {.speed = 1.0, .bam_mode = BAM_BINARY};
+    const char *dump_path = NULL, *golden_path = NULL;
+    long loops = 1, tolerance = 0;
+    bool dithering = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "o:g:t:i:l:s:b:fd")) != -1) {
+        switch (option) {
+            case 'o': dump_path = optarg; break;
+            case 'g': golden_path = optarg; break;
+            case 't':
+                if (!parse_number(optarg, 0, 255, &tolerance)) {
+                    fprintf(stderr, "Invalid tolerance %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i': sim.images_path = optarg; break;
+            case 'l':
+                if (!parse_number(optarg, 1, UINT16_MAX, &loops)) {
+                    fprintf(stderr, "Invalid loops %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                if (!parse_speed(optarg, &options.speed)) {
+                    fprintf(stderr, "Invalid speed %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                if (!parse_bam_mode(optarg, &options.bam_mode)) {
+                    fprintf(stderr, "Invalid BAM mode %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f': options.interpolator = &interpolator; break;
+            case 'd': dithering = true; break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (dithering && options.interpolator != NULL) {
+        fprintf(stderr, "Fading (-f) can't be combined with dithering (-d)\n");
+        return EXIT_FAILURE;
+    }
+
+    sim.tolerance = tolerance;
+    set_dithering(dithering);
+
+    set_bam_mode(options.bam_mode);
+
+    struct Animation animation = {0};
+    if (!parse_gif(argv[optind], &animation) || animation.frames_count == 0) {
+        return EXIT_FAILURE;
+    }
+
+    prepare_animation(&animation);
+
+    if (dump_path != NULL) {
+        sim.dump = strcmp(dump_path, "-") == 0 ? stdout :
+                   fopen(dump_path, "w");
+    }
+
+    if (golden_path != NULL) {
+        sim.golden = fopen(golden_path, "r");
+    }
+
+    if ((dump_path != NULL && sim.dump == NULL) ||
+        (golden_path != NULL && sim.golden == NULL))
+    {
+        fprintf(stderr, "Can't open %s\n", sim.dump ? golden_path : dump_path);
+        return EXIT_FAILURE;
+    }
+
+    if (sim.images_path != NULL && mkdir(sim.images_path, 0755) != 0 &&
+        errno != EEXIST)
+    {
+        fprintf(stderr, "Can't create directory %s\n", sim.images_path);
+        return EXIT_FAILURE;
+    }
+
+    struct Driver driver = {
+        .latch = sim_latch,
+        .show = sim_show,
+        .wait = sim_wait,
+        .clock = sim_clock,
+        .frame = sim_frame,
+        .context = &sim,
+    };
+
+    sim.frames_limit = animation.frames_count * loops;
+
+    uint64_t start = monotonic_ns();
+    multiplex(&animation, &driver, &options);
+
+    // The last level is lit for a full slot before the loop would go on.
+    elapse(&sim, sim.now + SLOT_NS);
+    finish_frame(&sim);
+    double elapsed = (double)(monotonic_ns() - start) / 1e9;
+
+    fprintf(stderr, "%u frames, %llu slots (%.2f s of playback) in %.3f s\n",
+            sim.frames_done, (unsigned long long)sim.total_slots,
+            (double)sim.now / 1e9, elapsed);
+    fprintf(stderr, "%.0f slots/s, %.1fx real time\n",
+            sim.total_slots / elapsed, (double)sim.now / 1e9 / elapsed);
+
+    fprintf(stderr, "Max contiguous off-time per LED by brightness:\n");
+    for (uint8_t brightness = 1; brightness < BRIGHTNESS; brightness++) {
+        uint64_t gap = sim.max_gap_by_brightness[brightness];
+        if (gap > 0) {
+            fprintf(stderr, "  %2d: %6llu us\n", brightness,
+                    (unsigned long long)gap / 1000);
+        }
+    }
+
+    fflush(stdout);
+    print_refresh_stats(&animation);
+    print_interpolation_stats(&interpolator);
+
+    if (sim.golden != NULL) {
+        finish_golden(&sim);
+        fprintf(stderr, "Golden comparison: %u mismatches\n", sim.mismatches);
+        fclose(sim.golden);
+    }
+
+    if (sim.dump != NULL && sim.dump != stdout) {
+        fclose(sim.dump);
+    }
+
+    free(animation.frames);
+    return sim.mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,84 @@
+#include "visualizers.h"
+#include "voxels.h"
+
+#include <math.h>
+#include <string.h>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+// --- Visualizers ----
+
+/**
+ * One column per band on the 8x8 grid (low frequencies on the first row);
+ * the column height follows the band's energy, colored from green at the
+ * bottom to red at the top.
+ */
+static void render_spectrum(struct Frame *frame, const float *bands) {
+    for (uint8_t row = 0; row < 8; row++) {
+        for (uint8_t column = 0; column < 8; column++) {
+            float value = bands[row * 8 + column];
+            uint8_t height = MIN((uint8_t)lroundf(value * 8), 8);
+
+            for (uint8_t level = 0; level < height; level++) {
+                set_led(frame, level, row, column, level * 11 / 7,
+                        15 - level * 2, 0);
+            }
+        }
+    }
+}
+
+/**
+ * A sphere around the center of the cube whose radius follows the bass; the
+ * color mixes bass (red), mids (green) and treble (blue).
+ */
+static void render_pulse(struct Frame *frame, const float *bands) {
+    float bass = 0, mids = 0, treble = 0;
+    for (uint8_t band = 0; band < VISUALIZER_BANDS; band++) {
+        if (band < 8) {
+            bass += bands[band] / 8;
+        } else if (band < 32) {
+            mids += bands[band] / 24;
+        } else {
+            treble += bands[band] / 32;
+        }
+    }
+
+    float radius = bass * 5.0f;
+    uint8_t red = MIN(lroundf(bass * 11), 11);
+    uint8_t green = MIN(lroundf(mids * 15), 15);
+    uint8_t blue = MIN(lroundf(treble * 15), 15);
+
+    for (uint8_t level = 0; level < 8; level++) {
+        for (uint8_t row = 0; row < 8; row++) {
+            for (uint8_t column = 0; column < 8; column++) {
+                float dx = column - 3.5f, dy = row - 3.5f, dz = level - 3.5f;
+                if (sqrtf(dx * dx + dy * dy + dz * dz) <= radius) {
+                    set_led(frame, level, row, column, red, green, blue);
+                }
+            }
+        }
+    }
+}
+
+static const struct Visualizer visualizers[] = {
+    {"spectrum", render_spectrum},
+    {"pulse", render_pulse},
+};
+
+// --- Exposed functions ----
+
+/**
+ * Returns the visualizer with the given name or NULL if there's none.
+ *
+ * - parameter name: The name of the visualizer (e.g. "spectrum").
+ */
+const struct Visualizer *find_visualizer(const char *name) {
+    size_t count = sizeof(visualizers) / sizeof(visualizers[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(visualizers[i].name, name) == 0) {
+            return &visualizers[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef _VISUALIZERSH_
+#define _VISUALIZERSH_
+
+#include "animation.h"
+
+/// Number of (log-spaced) frequency bands given to every visualizer.
+#define VISUALIZER_BANDS    64
+
+/**
+ * Renders a cube frame out of the current audio spectrum.
+ *
+ * - name:   The name used to select the visualizer on the command line.
+ * - render: Draws into the given (already cleared) frame. `bands` holds
+ *           VISUALIZER_BANDS values in [0, 1] from low to high frequencies.
+ */
+struct Visualizer {
+    const char *name;
+    void (*render)(struct Frame *frame, const float *bands);
+};
+
+/**
+ * Returns the visualizer with the given name or NULL if there's none.
+ *
+ * - parameter name: The name of the visualizer (e.g. "spectrum").
+ */
+const struct Visualizer *find_visualizer(const char *name);
+
+#endif
@@ -0,0 +1,129 @@
+#include "voxels.h"
+
+#include <math.h>
+#include <string.h>
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+/**
+ * Converts an 8 bits color component into the 4 bits brightness used by the
+ * bit angle modulation.
+ *
+ * - parameter component: The color component (0-255).
+ */
+uint8_t convert_to_4bits(int component) {
+    double percent = (double)component / 255.0;
+    return MIN(ceil(0b1111 * percent), 0b1111);
+}
+
+/**
+ * Sets the LED at the given position to the given brightness on each color,
+ * encoding it into the frame's bit planes.
+ *
+ * - parameter frame:  The frame that will be modified.
+ * - parameter level:  The level on the LED cube (0-7).
+ * - parameter row:    The y coordinate of the 2-D level (0-7).
+ * - parameter column: The x coordinate of the 2-D level (0-7).
+ * - parameter red:    The red component (0-15).
+ * - parameter green:  The green component (0-15).
+ * - parameter blue:   The blue component (0-15).
+ */
+void set_led(struct Frame *frame, uint8_t level, uint8_t row, uint8_t column,
+             uint8_t red, uint8_t green, uint8_t blue)
+{
+    uint8_t mask = 1 << column;
+    for (uint8_t bit = 0; bit < BAM_BITS; bit++) {
+        uint8_t *planes = frame->cube[bit][level];
+        planes[row] = (planes[row] & ~mask) | (((red >> bit) & 1) << column);
+        planes[row + 8] = (planes[row + 8] & ~mask) |
+                          (((green >> bit) & 1) << column);
+        planes[row + 16] = (planes[row + 16] & ~mask) |
+                           (((blue >> bit) & 1) << column);
+    }
+}
+
+/**
+ * Sets the LED at the given position to the given 8 bits color, converted to
+ * 4 bits brightnesses (with red capped at MAX_RED_BRIGHTNESS) the same way
+ * GIF pixels are.
+ *
+ * - parameter frame:  The frame that will be modified.
+ * - parameter level:  The level on the LED cube (0-7).
+ * - parameter row:    The y coordinate of the 2-D level (0-7).
+ * - parameter column: The x coordinate of the 2-D level (0-7).
+ * - parameter red:    The red component (0-255).
+ * - parameter green:  The green component (0-255).
+ * - parameter blue:   The blue component (0-255).
+ */
+void set_color_led(struct Frame *frame, uint8_t level, uint8_t row,
+                   uint8_t column, uint8_t red, uint8_t green, uint8_t blue)
+{
+    set_led(frame, level, row, column,
+            MIN(convert_to_4bits(red), MAX_RED_BRIGHTNESS),
+            convert_to_4bits(green), convert_to_4bits(blue));
+}
+
+/**
+ * Returns the order in which the given phase gets the extra brightness: the
+ * bit reversal of its index, so extra phases are spread evenly over the
+ * cycle (e.g. 0, 2, 1, 3 for 4 phases).
+ */
+static uint8_t dither_threshold(uint8_t phase, uint8_t count) {
+    uint8_t threshold = 0;
+    for (uint8_t bit = 1; bit < count; bit <<= 1) {
+        threshold = (threshold << 1) | ((phase & bit) != 0);
+    }
+
+    return threshold;
+}
+
+/**
+ * Sets the LED at the given position to the given 8 bits color on every
+ * phase of a dithered frame. The part of each component that falls between
+ * two 4 bits brightnesses is rendered by showing the next brightness on a
+ * proportional number of phases, in an ordered pattern that is shifted for
+ * neighbouring LEDs so they don't all blink together.
+ *
+ * - parameter phases: The `count` consecutive phases of the frame.
+ * - parameter count:  The number of phases (a power of two).
+ * - parameter level:  The level on the LED cube (0-7).
+ * - parameter row:    The y coordinate of the 2-D level (0-7).
+ * - parameter column: The x coordinate of the 2-D level (0-7).
+ * - parameter red:    The red component (0-255).
+ * - parameter green:  The green component (0-255).
+ * - parameter blue:   The blue component (0-255).
+ */
+void set_dithered_led(struct Frame *phases, uint8_t count, uint8_t level,
+                      uint8_t row, uint8_t column, uint8_t red, uint8_t green,
+                      uint8_t blue)
+{
+    // Brightness in 1/count steps, split into the 4 bits part and the
+    // number of phases that show one more.
+    const uint8_t components[3] = {red, green, blue};
+    uint8_t base[3], extra[3];
+    for (uint8_t color = 0; color < 3; color++) {
+        uint16_t value = (components[color] * 15 * count + 127) / 255;
+        base[color] = value / count;
+        extra[color] = value % count;
+    }
+
+    // Levels share the pattern: identical levels keep identical planes, so
+    // the refresh loop can still skip them (see `struct Frame`).
+    uint8_t offset = column + 2 * row;
+    for (uint8_t phase = 0; phase < count; phase++) {
+        uint8_t threshold = dither_threshold((phase + offset) % count, count);
+        set_led(&phases[phase], level, row, column,
+                base[0] + (threshold < extra[0]),
+                base[1] + (threshold < extra[1]),
+                base[2] + (threshold < extra[2]));
+    }
+}
+
+/**
+ * Sets all the LEDs of the frame to off.
+ *
+ * - parameter frame: The frame that will be cleared.
+ */
+void clear_frame(struct Frame *frame) {
+    memset(frame->cube, 0, sizeof(frame->cube));
+}
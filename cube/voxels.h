@@ -0,0 +1,82 @@
+#ifndef _VOXELSH_
+#define _VOXELSH_
+
+#include "animation.h"
+
+/// Number of BAM cycles a dithered frame cycles through (a power of two);
+/// each one gets its own copy of the bit planes. Two phases add half a
+/// brightness step and repeat every other cycle (about 28 Hz); more phases
+/// would repeat slowly enough to flicker visibly.
+#define DITHER_PHASES   2
+
+/// Red LEDs are noticeably brighter than green and blue ones; their
+/// brightness is capped to keep colors balanced.
+#define MAX_RED_BRIGHTNESS  11
+
+/**
+ * Converts an 8 bits color component into the 4 bits brightness used by the
+ * bit angle modulation.
+ *
+ * - parameter component: The color component (0-255).
+ */
+uint8_t convert_to_4bits(int component);
+
+/**
+ * Sets the LED at the given position to the given brightness on each color,
+ * encoding it into the frame's bit planes.
+ *
+ * - parameter frame:  The frame that will be modified.
+ * - parameter level:  The level on the LED cube (0-7).
+ * - parameter row:    The y coordinate of the 2-D level (0-7).
+ * - parameter column: The x coordinate of the 2-D level (0-7).
+ * - parameter red:    The red component (0-15).
+ * - parameter green:  The green component (0-15).
+ * - parameter blue:   The blue component (0-15).
+ */
+void set_led(struct Frame *frame, uint8_t level, uint8_t row, uint8_t column,
+             uint8_t red, uint8_t green, uint8_t blue);
+
+/**
+ * Sets the LED at the given position to the given 8 bits color, converted to
+ * 4 bits brightnesses (with red capped at MAX_RED_BRIGHTNESS) the same way
+ * GIF pixels are.
+ *
+ * - parameter frame:  The frame that will be modified.
+ * - parameter level:  The level on the LED cube (0-7).
+ * - parameter row:    The y coordinate of the 2-D level (0-7).
+ * - parameter column: The x coordinate of the 2-D level (0-7).
+ * - parameter red:    The red component (0-255).
+ * - parameter green:  The green component (0-255).
+ * - parameter blue:   The blue component (0-255).
+ */
+void set_color_led(struct Frame *frame, uint8_t level, uint8_t row,
+                   uint8_t column, uint8_t red, uint8_t green, uint8_t blue);
+
+/**
+ * Sets the LED at the given position to the given 8 bits color on every
+ * phase of a dithered frame. The part of each component that falls between
+ * two 4 bits brightnesses is rendered by showing the next brightness on a
+ * proportional number of phases, in an ordered pattern that is shifted for
+ * neighbouring LEDs so they don't all blink together.
+ *
+ * - parameter phases: The `count` consecutive phases of the frame.
+ * - parameter count:  The number of phases (a power of two).
+ * - parameter level:  The level on the LED cube (0-7).
+ * - parameter row:    The y coordinate of the 2-D level (0-7).
+ * - parameter column: The x coordinate of the 2-D level (0-7).
+ * - parameter red:    The red component (0-255).
+ * - parameter green:  The green component (0-255).
+ * - parameter blue:   The blue component (0-255).
+ */
+void set_dithered_led(struct Frame *phases, uint8_t count, uint8_t level,
+                      uint8_t row, uint8_t column, uint8_t red, uint8_t green,
+                      uint8_t blue);
+
+/**
+ * Sets all the LEDs of the frame to off.
+ *
+ * - parameter frame: The frame that will be cleared.
+ */
+void clear_frame(struct Frame *frame);
+
+#endif